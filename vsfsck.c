@@ -1,8 +1,28 @@
+#define _GNU_SOURCE // SEEK_DATA/SEEK_HOLE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/falloc.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#ifdef VSFSCK_WITH_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // ? ############################## Defining Constants and Global Variables ##############################
 
@@ -20,9 +40,86 @@
 #define INODECOUNT ((INODETABNUMBLOCKS * BLOCKSIZE) / INODESIZE)
 #define MAGICNUM 0xD34D
 #define POINTERSPBLOCK (BLOCKSIZE / sizeof(uint32_t))
-
-int referencedByAnyInode[TOTALBLOCKS];
-int referencedByValidInode[TOTALBLOCKS];
+#define MAXINODESPERBLOCK 64 // one bit per slot in an InodeBlockMasks word
+#define POINTERCLASSWORDS (POINTERSPBLOCK / 64) // PointerBlockClass words, one bit per pointer block entry
+
+// Images are little-endian on every host. Defining HOSTISBIGENDIAN=1 on a little-endian host
+// exercises the byte-swapping decode path against byte-swapped images.
+#ifndef HOSTISBIGENDIAN
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOSTISBIGENDIAN 1
+#else
+#define HOSTISBIGENDIAN 0
+#endif
+#endif
+
+#define EXITCANCELLED 32 // fsck(8) convention: checking cancelled by user request
+#define UNDOLOGMAGIC "VSFSUNDO"
+#define UNDOLOGVERSION 1
+#define UNDORECORDMAGIC 0x4F444E55 // "UNDO"
+#define CLEANSTATEMAGIC 0x4E4C4353 // "SCLN"
+#define MAXMOUNTSBETWEENCHECKS 20  // --fast runs a full check anyway after this many mounts
+#define MAXREPAIRROUNDS 8 // repair rounds before giving up on reaching a fixpoint
+#define GROUPLAYOUTMAGIC 0x50524756 // "VGRP"
+#define MAXGROUPS (BLOCKSIZE / sizeof(GroupDescriptor)) // the descriptor table is one block
+#define MAXBLOCKSPERGROUP (BLOCKSIZE * 8)			  // one data bitmap block per group
+#define ZSTDFRAMEMAGIC 0xFD2FB528
+#define SEEKTABLESKIPPABLEMAGIC 0x184D2A5E // skippable frame holding the seek table of a seekable image
+#define SEEKTABLEMAGIC 0x8F92EAB1
+#define SEEKTABLEFOOTERSIZE 9
+#define MAXCOMPRESSEDIMAGES 4
+#define COMPRESSEDCACHEFRAMES 8				 // decompressed frames kept per compressed image
+#define MAXCOMPRESSEDFRAMESIZE (16u << 20) // larger frames are refused rather than buffered
+#define BLOCKMAPMAGIC "VSFSMAP"
+#define BLOCKMAPVERSION 1
+#define BLOCKMAPNOOWNER 0xFFFFFFFF
+#define MAXPATHLEN 4096
+#define MAXIMAGEHANDLES 256 // image state is kept per file descriptor below this number
+#define MAXDIRECTIMAGES 4
+#define MAXSPARSEIMAGES 4
+#define POINTERCACHESLOTS 32 // pointer blocks kept by an image opened with --direct
+#define ARENACHUNKSIZE (32 * BLOCKSIZE)
+#define MAXTREEDEPTH 3 // triple indirect
+#define WALKSPLITGRAIN 16 // child ranges of upper tree levels larger than this are split for stealing
+#define WALKTASKINODE 0
+#define WALKTASKRANGE 1
+#define MAXWALKJOBS 1024
+#define WALKIDLEPOLLMS 100 // an idle main thread still prints status lines this often
+
+#define BLOCKSTATEWORDS ((TOTALBLOCKS + 63) / 64)
+
+// Bitplanes of the block state table, one bit per block in each
+enum
+{
+	PLANEREFVALID,	   // referenced by a valid inode
+	PLANEREFANY,	   // referenced by any inode, deleted ones included
+	PLANEMARKED,	   // marked used in the data bitmap
+	PLANEPOINTERBLOCK, // holds pointers of an indirect tree
+	PLANEDUPLICATED,   // referenced more than once by valid inodes
+	PLANEFREED,		   // released from the data bitmap by a repair of this run
+	NUMBLOCKPLANES
+};
+
+// Each plane is a run of contiguous words so rules evaluate 64 blocks per operation
+uint64_t blockState[NUMBLOCKPLANES][BLOCKSTATEWORDS];
+
+// Progress counters are bumped with relaxed atomics from the scan loops and read from anywhere
+atomic_uint_fast64_t inodesScannedCounter;
+atomic_uint_fast64_t pointerBlocksVisitedCounter;
+atomic_uint_fast64_t repairsQueuedCounter;
+_Atomic(const char *) currentPhaseName = "Starting";
+
+// Undo log of the image being repaired, opened on the first write
+char undoLogPath[MAXPATHLEN];
+int undoLogEnabled = 0;
+int undoLogFailed = 0; // an append failed, every later repair write is refused
+int undoLogFd = -1;
+unsigned char undoLoggedBlocks[TOTALBLOCKS / 8];
+
+// Set from signal handlers only, consumed at safe points by pollCheckStatus
+volatile sig_atomic_t statusLineDue = 0;
+volatile sig_atomic_t statusDumpRequested = 0;
+volatile sig_atomic_t cancelRequested = 0;
 
 /*
  ! PROJECT INFORMATION
@@ -60,6 +157,327 @@ typedef struct
 	unsigned char reserved[4058];
 } Superblock;
 
+typedef struct
+{
+	uint64_t inodesScanned;
+	uint64_t pointerBlocksVisited;
+	uint64_t repairsQueued;
+	const char *phase;
+	int cancelled;
+} CheckProgress;
+
+// Per inode-table block classification, bit j describes inode slot j of the block
+typedef struct
+{
+	uint64_t nonEmpty;		   // slot has at least one non-zero byte
+	uint64_t valid;			   // links > 0 and no deletion time
+	uint64_t deletedAllocated; // not valid but still claims data blocks
+} InodeBlockMasks;
+
+// The fields the inode prefilter tests, gathered out of the 256-byte records of one inode-table
+// block into one dense array per field
+typedef struct
+{
+	uint32_t numHardLinks[MAXINODESPERBLOCK];
+	uint32_t deletionTime[MAXINODESPERBLOCK];
+	uint32_t numDataBlocksAllocated[MAXINODESPERBLOCK];
+} InodeHotFields;
+
+// Per pointer-block classification, bit k % 64 of word k / 64 describes entry k. Entries in neither
+// mask point into the data region.
+typedef struct
+{
+	uint64_t zero[POINTERCLASSWORDS]; // entry is 0, no block
+	uint64_t bad[POINTERCLASSWORDS];  // entry names a block outside the data region
+} PointerBlockClass;
+
+// One frame of a zstd seekable image, as its seek table describes it
+typedef struct
+{
+	uint64_t compressedOffset;
+	uint64_t decompressedOffset;
+	uint32_t compressedSize;
+	uint32_t decompressedSize;
+} CompressedFrame;
+
+// Frame index and decompressed-frame cache of a compressed image, shared by every handle on it
+typedef struct
+{
+	int isLoaded;
+	dev_t device;
+	ino_t inode;
+	CompressedFrame *frames;
+	unsigned char *isFrameDamaged; // per frame, set once it failed to decompress so it is reported once
+	uint32_t numFrames;
+	uint64_t decompressedSize;
+	unsigned char *compressedBuffer; // the frame being decompressed, sized for the largest
+	unsigned char *cacheData[COMPRESSEDCACHEFRAMES];
+	uint32_t cacheCapacity[COMPRESSEDCACHEFRAMES];
+	uint32_t cacheFrame[COMPRESSEDCACHEFRAMES]; // frame number + 1, 0 for an empty slot
+	uint64_t cacheUse[COMPRESSEDCACHEFRAMES];	// useClock at the last use, the smallest is evicted
+	uint64_t useClock;
+	uint32_t framesDecompressed;
+	pthread_mutex_t lock; // walkers read concurrently
+} CompressedImage;
+
+// Caches of an image opened with --direct, shared by every handle on it so they outlive the phase
+// that filled them. Every write to the image goes through writeDirectBlock, which keeps them current.
+typedef struct
+{
+	int isLoaded;
+	dev_t device;
+	ino_t inode;
+	unsigned char *metaCache; // blocks [0, metaBlocks) read in one aligned transfer at the first open
+	uint32_t metaBlocks;
+	unsigned char *pointerCache;				  // direct-mapped copies of pointer blocks
+	uint32_t pointerCacheTags[POINTERCACHESLOTS]; // block number + 1, 0 for an empty slot
+	pthread_mutex_t cacheLock;					  // guards pointerCache, walkers read concurrently
+} DirectImage;
+
+// Holes of an image file, located once per run and shared by every handle on it. Writes and
+// discards through any handle keep the map current.
+typedef struct
+{
+	int isLoaded;
+	dev_t device;
+	ino_t inode;
+	uint32_t numBlocks;		// blocks covered by holeMap, anything past it is beyond EOF
+	unsigned char *holeMap; // bit set when the whole block lies in a hole, NULL if unknown
+} SparseImage;
+
+typedef struct
+{
+	int isOpen;
+	SparseImage *sparse;		 // NULL for an empty or compressed image
+	DirectImage *direct;		 // set when opened with O_DIRECT, transfers bypass the page cache
+	int isOverlaid;				 // the repair overlay stands in front of this image
+	CompressedImage *compressed; // set for a zstd seekable image, which is only read
+} ImageHandle;
+
+// Per open image state, indexed by file descriptor
+ImageHandle imageHandles[MAXIMAGEHANDLES];
+
+// Compressed images indexed so far, and repairs that could not be written to one
+CompressedImage compressedImages[MAXCOMPRESSEDIMAGES];
+uint32_t unwrittenRepairBlocks = 0;
+
+// Images opened with --direct so far
+DirectImage directImages[MAXDIRECTIMAGES];
+
+// Images whose holes have been located so far
+SparseImage sparseImages[MAXSPARSEIMAGES];
+
+// Repair phases of the fixpoint loop, in the order a round runs them
+enum
+{
+	REPAIRPHASESUPERBLOCK,
+	REPAIRPHASEINODEBITMAP,
+	REPAIRPHASEDATABITMAP,
+	REPAIRPHASEPOINTERS,
+	REPAIRPHASEDUPLICATES,
+	NUMREPAIRPHASES
+};
+
+// Image regions, a write to one makes every phase that reads it due again
+#define REGIONSUPERBLOCK 1
+#define REGIONINODEBITMAP 2
+#define REGIONDATABITMAP 4
+#define REGIONINODETABLE 8
+#define REGIONDATA 16
+
+// In-memory copy of the image under repair. Repairs write here instead of to disk; once no phase
+// is due any more the dirty blocks are committed in one go.
+typedef struct
+{
+	int isActive;
+	dev_t device; // identifies the image whichever path it is opened by
+	ino_t inode;
+	unsigned char *blocks[TOTALBLOCKS]; // NULL until the block is first written
+	unsigned char dirty[TOTALBLOCKS / 8];
+	uint32_t duePhases; // bit p set while phase p has not seen a write to a region it reads
+	pthread_mutex_t lock; // guards blocks against walkers reading a repaired block
+} RepairOverlay;
+
+RepairOverlay repairOverlay = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Per-run arena: bump allocation out of block-aligned chunks, released in bulk
+typedef struct ArenaChunk
+{
+	struct ArenaChunk *previous;
+	size_t used;
+	size_t capacity;
+	unsigned char *memory;
+} ArenaChunk;
+
+typedef struct
+{
+	ArenaChunk *current;
+	ArenaChunk *spare;			 // released chunks kept for reuse
+	unsigned char *depthScratch; // one pointer block per tree depth, outside the bump region
+} Arena;
+
+typedef struct
+{
+	ArenaChunk *chunk;
+	size_t used;
+} ArenaMark;
+
+// Scratch memory of the running check
+Arena runArena;
+
+// Images are opened with O_DIRECT and cached privately instead of in the page cache
+int directIOEnabled = 0;
+
+// Workers used by the block collection walk, 1 keeps it on the main thread
+int walkJobs = 1;
+
+// Undo log layout: one UndoLogHeader, then UndoRecordHeader + original block contents per record.
+// The header fields are little-endian.
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t blockSize;
+} UndoLogHeader;
+
+typedef struct
+{
+	uint32_t recordMagic;
+	uint32_t blockNum;
+	uint64_t checksum; // hashBlock of the original contents
+} UndoRecordHeader;
+
+// Block ownership map written by --export-map. All fields are little-endian and every section
+// starts 8-byte aligned, so readers can mmap the file and index the tables directly.
+typedef struct
+{
+	char magic[8]; // BLOCKMAPMAGIC
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t blockSize;
+	uint32_t totalBlocks;
+	uint32_t inodeCount;
+	uint32_t firstDataBlock;
+	uint32_t flags; // BLOCKMAPCHECKERRORS when the check that produced the map found errors
+	uint32_t extentCount;
+	uint64_t blockTableOffset;	// totalBlocks BlockMapEntry records
+	uint64_t inodeTableOffset;	// inodeCount BlockMapInode records
+	uint64_t extentTableOffset; // extentCount BlockMapExtent records
+} BlockMapHeader;
+
+#define BLOCKMAPCHECKERRORS 1
+
+enum
+{
+	BLOCKROLEFREE,	   // not owned by any valid inode
+	BLOCKROLEMETADATA, // superblock, bitmaps or inode table
+	BLOCKROLEDATA,
+	BLOCKROLEPOINTER // indirect block, level says which
+};
+
+typedef struct
+{
+	uint32_t owner;	  // owning inode, BLOCKMAPNOOWNER for free and metadata blocks
+	uint32_t logical; // logical block of a data block, first logical block mapped by a pointer block
+	uint8_t role;
+	uint8_t level; // 1-3 for single/double/triple indirect pointer blocks, 0 otherwise
+	uint16_t reserved;
+} BlockMapEntry;
+
+typedef struct
+{
+	uint32_t firstExtent; // index into the extent table
+	uint32_t extentCount;
+	uint32_t dataBlocks;
+	uint32_t pointerBlocks;
+} BlockMapInode;
+
+typedef struct
+{
+	uint32_t logicalStart;
+	uint32_t physicalStart;
+	uint32_t length;
+} BlockMapExtent;
+
+// The map keeps logical block numbers in 32 bits. That holds every one an inode can address: the
+// direct pointers and the three indirect trees end below 2^32 logical blocks.
+_Static_assert(12 + (uint64_t)POINTERSPBLOCK + ((uint64_t)POINTERSPBLOCK * POINTERSPBLOCK) +
+					   ((uint64_t)POINTERSPBLOCK * POINTERSPBLOCK * POINTERSPBLOCK) <=
+				   (uint64_t)UINT32_MAX + 1,
+			   "Logical block numbers of the block map must fit in 32 bits");
+
+// Clean state marker, kept at the start of the superblock reserved area. A check that finds nothing
+// sets cleanFlag and records the bitmap summary counts; whoever mounts the image clears cleanFlag
+// while it is mounted and increments mountCount.
+typedef struct
+{
+	uint32_t magic;				  // CLEANSTATEMAGIC once a check has written the marker
+	uint32_t cleanFlag;			  // 1 when the last check found no errors and nothing changed since
+	uint32_t mountCount;		  // mounts since the last clean check
+	uint32_t lastCheckGeneration; // bumped by every clean check
+	uint32_t usedDataBlocks;	  // bits set in the data bitmap at the last clean check
+	uint32_t usedInodes;		  // bits set in the inode bitmap at the last clean check
+} CleanStateMarker;
+
+// Block group extension, stored in the superblock reserved area right after the clean state marker.
+// Group g covers blocks [g * blocksPerGroup, (g + 1) * blocksPerGroup) and inodes
+// [g * inodesPerGroup, (g + 1) * inodesPerGroup). Group 0 starts with the superblock and the
+// descriptor table, then each group holds its inode bitmap, data bitmap, inode table and data.
+typedef struct
+{
+	uint32_t magic; // GROUPLAYOUTMAGIC, anything else is a single-group legacy image
+	uint32_t blocksPerGroup;
+	uint32_t inodesPerGroup;
+	uint32_t groupCount;
+	uint32_t descriptorBlock; // block of the group descriptor table, follows the superblock
+} GroupLayout;
+
+typedef struct
+{
+	uint32_t inodeBitmapBlock;
+	uint32_t dataBitmapBlock;
+	uint32_t inodeTableBlock;
+	uint32_t firstDataBlock; // bit 0 of the group data bitmap
+	uint32_t freeDataBlocks;
+	uint32_t freeInodes;
+	uint32_t reserved[2];
+} GroupDescriptor;
+
+// A pointer from one group's inode into another group's data, settled in the merge step
+typedef struct
+{
+	uint32_t blockNum;
+	uint32_t inodeNum;
+	uint32_t level; // 0 for a data block, 1-3 for a pointer block whose tree the merge step walks
+} CrossGroupReference;
+
+// Everything the check of one group touches, owned by whichever worker checks the group
+typedef struct
+{
+	uint32_t groupNum;
+	GroupDescriptor expected; // canonical layout, free counts filled in after the merge
+	unsigned char inodeBitmap[BLOCKSIZE];
+	unsigned char dataBitmap[BLOCKSIZE];
+	unsigned char validInodes[BLOCKSIZE]; // the inode bitmap as the inode table says it should be
+	unsigned char referenced[BLOCKSIZE];  // data blocks of this group referenced by valid inodes
+	CrossGroupReference *outbox;		  // references into other groups
+	uint32_t outboxCount;
+	uint32_t outboxCapacity;
+	FILE *report; // findings, printed in group order once all groups are done
+	char *reportText;
+	size_t reportSize;
+	int errors;
+	int inodeBitmapErrors; // the part of errors the inode bitmap repair takes care of
+} GroupCheck;
+
+typedef struct
+{
+	GroupCheck **checks;
+	const GroupLayout *layout;
+	int fd;
+	atomic_uint nextGroup;
+} GroupPool;
+
 typedef struct
 {
 	uint32_t mode;
@@ -79,24 +497,212 @@ typedef struct
 	unsigned char reserved[156];
 } Inode;
 
+// One block of an inode's tree as the walker met it. Entries are kept in depth-first pre-order,
+// each pointer block directly ahead of the blocks it maps
+typedef struct
+{
+	uint64_t logical; // logical block of a data block, first logical block mapped by a pointer block
+	uint32_t physical;
+	uint32_t level; // 0 for data, 1-3 for single/double/triple indirect pointer blocks
+} LayoutEntry;
+
+typedef struct
+{
+	LayoutEntry *entries;
+	uint32_t count;
+	uint32_t capacity;
+} InodeLayout;
+
+// A layout entry met on the pool, kept with its inode until the join
+typedef struct
+{
+	uint32_t inodeNum;
+	LayoutEntry entry;
+} WalkLayoutEntry;
+
+// One unit of work for the block collection walk: a whole inode, or a child range [first, end)
+// of one pointer block of an inode's tree
+typedef struct
+{
+	int kind;
+	uint32_t inodeNum;
+	int isInodeValid;
+	const Inode *inode;
+	uint32_t block;
+	int level;
+	uint64_t logicalBase;
+	uint32_t first;
+	uint32_t end;
+} WalkTask;
+
+// A finding reported off the main thread, printed after the walk in the order a sequential walk would use
+typedef struct
+{
+	uint32_t inodeNum;
+	uint64_t logicalKey;
+	uint32_t sequence;
+	char text[160];
+} WalkMessage;
+
+typedef struct WalkPool WalkPool;
+
+typedef struct
+{
+	pthread_mutex_t lock; // guards the task deque
+	WalkTask *tasks;
+	uint32_t head; // thieves steal from here
+	uint32_t tail; // the owner pushes and pops here
+	uint32_t capacity;
+	WalkMessage *messages;
+	uint32_t messageCount;
+	uint32_t messageCapacity;
+	WalkLayoutEntry *layoutEntries;
+	uint32_t layoutCount;
+	uint32_t layoutCapacity;
+	unsigned char *scratch; // one pointer block per tree depth
+	WalkPool *pool;
+	int index; // worker 0 is the main thread
+} WalkWorker;
+
+struct WalkPool
+{
+	int fd;
+	WalkWorker *workers;
+	int numWorkers;
+	atomic_int outstandingTasks;
+	pthread_mutex_t idleLock;	  // with workAvailable, parks workers that found nothing to run
+	pthread_cond_t workAvailable; // signalled on every push, broadcast once the last task is done
+	atomic_uint pushGeneration;	  // raised under idleLock on every push
+	InodeLayout *layouts;		  // when set, the trees of valid inodes are recorded here
+};
+
+// Walk state of one inode's block tree. worker is NULL when walking on the main thread alone
+typedef struct
+{
+	int fd;
+	uint32_t inodeNum;
+	int isInodeValid;
+	WalkWorker *worker;
+	InodeLayout *layout; // when set and the inode is valid, every block of the tree is recorded here
+	Arena *layoutArena;	 // where layout grows
+	int isQuiet;		 // findings are not reported again, e.g. on a layout-only walk
+} WalkContext;
+
+// Layouts of the valid inodes as the last data bitmap walk met them. --export-map uses them instead
+// of walking every tree again, unless a repair or --defrag changed the trees after that walk.
+typedef struct
+{
+	int isRequested; // only recorded when a map is going to be exported
+	int isCurrent;
+	Arena arena;
+	InodeLayout inodes[INODECOUNT];
+	uint32_t validInodes[INODECOUNT];
+	uint32_t validCount;
+} RecordedLayouts;
+
+RecordedLayouts walkLayouts;
+
 // ? ############################## Helper Functions References ##############################
 
+int openImage(char *image, int flags);
+void closeImage(int fd);
+int isBlockHole(int fd, uint32_t blockNum);
+int isDirectImage(int fd);
+void readDirectBlock(int fd, uint32_t blockNum, unsigned char *buffer);
+int writeDirectBlock(int fd, uint32_t blockNum, const unsigned char *buffer);
+void noteBlocksDiscarded(int fd, uint32_t firstBlock, uint32_t count, int isHole);
+void beginRepairOverlay(char *image);
+int isOverlayTarget(int fd);
+int isOverlayDirty(uint32_t blockNum);
+void readOverlayBlock(int fd, uint32_t blockNum, unsigned char *buffer);
+void writeOverlayBlock(int fd, uint32_t blockNum, const unsigned char *buffer);
+int takeRepairPhase(int phase);
+int isAnyRepairPhaseDue(void);
+int commitRepairOverlay(char *image);
+void endRepairOverlay(void);
 void readBlock(int fd, uint32_t blockNum, unsigned char *buffer);
-void writeBlock(int fd, uint32_t blockNum, unsigned char *buffer);
+int writeBlock(int fd, uint32_t blockNum, unsigned char *buffer);
 int bitCheck(const unsigned char *bitMap, int bitIndex);
 void setBit(unsigned char *bitMap, int bitIndex);
 void removeBit(unsigned char *bitMap, int bitIndex);
 int validateSuperblock(char *image);
 void fixSuperBlock(char *image);
-void markDataBlockReference(uint32_t inodeNum, uint32_t dataBlockAddress, int isCurrentInodeValid);
-void processIndirectBPointers(int fd, uint32_t inodeNum, uint32_t indirectBlockAddress, int level, int isCurrentInodeValid);
-void collectBlocksForInode(int fd, uint32_t inodeNum, Inode *currentInode);
+void markDataBlockReference(WalkContext *walk, uint32_t dataBlockAddress, uint64_t logicalIndex);
+void processIndirectBPointers(WalkContext *walk, uint32_t indirectBlockAddress, int level, uint64_t logicalBase);
+void walkPointerRange(WalkContext *walk, uint32_t indirectBlockAddress, int level, uint64_t logicalBase, uint32_t first, uint32_t end);
+void collectBlocksForInode(WalkContext *walk, Inode *currentInode);
 int validateDataBitmap(char *image);
 void fixDataBitmap(char *image);
 int validateInodeBitmap(char *image);
 void fixInodeBitmap(char *image);
 int validateAndFixBlockPointers(char *image);
 int detectAndFixDuplicateBlocks(char *image);
+void installProgressHandlers(int statusIntervalSeconds);
+void setCheckPhase(const char *phase);
+void getCheckProgress(CheckProgress *progress);
+void requestCheckCancel(void);
+int isCheckCancelled(void);
+int pollCheckStatus(void);
+void noteInodesScanned(uint32_t count);
+void notePointerBlockVisited(void);
+int reportCheckCancelled(void);
+void setBlockState(int plane, uint32_t blockNum);
+int testBlockState(int plane, uint32_t blockNum);
+void clearBlockPlane(int plane);
+uint64_t blockRangeMask(uint32_t word, uint32_t firstBlock, uint32_t lastBlock);
+void loadBitmapPlane(int plane, const unsigned char *bitMap, uint32_t firstBlock, uint32_t lastBlock);
+void storeBitmapPlane(int plane, unsigned char *bitMap, uint32_t firstBlock, uint32_t lastBlock);
+void swapLE32Words(uint32_t *words, size_t count);
+void swapSuperblock(Superblock *sbPTR);
+void swapInodeRecords(unsigned char *buffer, uint32_t count);
+void readSuperblock(int fd, Superblock *sbPTR);
+void writeSuperblock(int fd, const Superblock *sbPTR);
+void readInodeBlock(int fd, uint32_t blockNum, unsigned char *buffer);
+void writeInodeBlock(int fd, uint32_t blockNum, const unsigned char *buffer);
+void readWordBlock(int fd, uint32_t blockNum, uint32_t *words);
+void writeWordBlock(int fd, uint32_t blockNum, const uint32_t *words);
+void swapUndoLogHeader(UndoLogHeader *header);
+void swapUndoRecordHeader(UndoRecordHeader *record);
+int isZeroRecord(const unsigned char *record, uint32_t size);
+void classifyInodeBlock(const unsigned char *blockBuffer, uint32_t inodesPerBlock, uint32_t inodeSize, InodeBlockMasks *masks);
+uint64_t extractBitmapBits(const unsigned char *bitMap, uint32_t firstBit, uint32_t count);
+uint32_t classifyPointerBlock(const uint32_t *pointers, PointerBlockClass *cls);
+uint64_t hashBlock(const unsigned char *buffer);
+int isSuperblockConsistent(const Superblock *sbPTR);
+int restoreFromReference(char *image, char *reference);
+uint32_t countBitmapBits(const unsigned char *bitMap, uint32_t numBytes);
+int isImageMarkedClean(char *image);
+void recordCheckResult(char *image, int isClean);
+int discardFreedBlocks(char *image);
+void recordBlockLayout(Arena *arena, InodeLayout *layout, uint64_t logical, uint32_t physical, int level);
+int exportBlockMap(char *image, char *mapPath, int checkErrors);
+void groupCanonicalLayout(const GroupLayout *layout, uint32_t groupNum, GroupDescriptor *descriptor);
+int readGroupLayout(char *image, GroupLayout *layout);
+void walkGroupPointer(GroupCheck *check, const GroupLayout *layout, int fd, unsigned char *scratch, uint32_t inodeNum,
+					  uint32_t blockNum, int level);
+void checkGroup(GroupCheck *check, const GroupLayout *layout, int fd, unsigned char *scratch);
+int checkGroupedImage(char *image, const GroupLayout *layout);
+int isZstdImageFile(const char *image);
+CompressedImage *loadCompressedImage(int fd);
+void readCompressedBlock(int fd, uint32_t blockNum, unsigned char *buffer);
+void reportCompressedImage(void);
+int collectImageLayout(int fd, InodeLayout *layouts, uint32_t *validInodes);
+void reportFragmentation(char *image);
+int defragmentImage(char *image);
+void enableUndoLog(char *image);
+int logBlockForUndo(int fd, uint32_t blockNum);
+void closeUndoLog(void);
+int rollbackFromUndoLog(char *image);
+void *arenaAlloc(Arena *arena, size_t size, size_t alignment);
+unsigned char *arenaAllocBlock(Arena *arena);
+ArenaMark arenaMark(Arena *arena);
+void arenaRelease(Arena *arena, ArenaMark mark);
+void arenaFree(Arena *arena);
+unsigned char *walkerScratchBlock(int depth);
+void pushWalkTask(WalkWorker *worker, const WalkTask *task);
+void walkReport(WalkContext *walk, uint64_t logicalKey, const char *format, ...);
+void collectBlocksInParallel(int fd, Inode *inodes, uint32_t *inodeNums, uint32_t count, int numWorkers,
+							 InodeLayout *layouts, Arena *layoutArena);
 
 // ! ############################## MAIN FUNCTION ##############################
 // * ############################## MAIN FUNCTION ##############################
@@ -104,101 +710,495 @@ int detectAndFixDuplicateBlocks(char *image);
 
 int main(int argc, char *argv[])
 {
-	if (argc != 2)
+	char *image = NULL;
+	char *reference = NULL;
+	int statusIntervalSeconds = 0;
+	int rollback = 0;
+	int useUndoLog = 1;
+	int fastCheck = 0;
+	int fragReport = 0;
+	int defrag = 0;
+	int discard = 0;
+	char *exportMapPath = NULL;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--progress") == 0)
+		{
+			statusIntervalSeconds = 1;
+		}
+		else if (strcmp(argv[i], "--reference") == 0 && i + 1 < argc)
+		{
+			reference = argv[++i];
+		}
+		else if (strcmp(argv[i], "--undo") == 0)
+		{
+			rollback = 1;
+		}
+		else if (strcmp(argv[i], "--no-undo") == 0)
+		{
+			useUndoLog = 0;
+		}
+		else if (strcmp(argv[i], "--export-map") == 0 && i + 1 < argc)
+		{
+			exportMapPath = argv[++i];
+		}
+		else if (strcmp(argv[i], "--discard") == 0)
+		{
+			discard = 1;
+		}
+		else if (strcmp(argv[i], "--frag") == 0)
+		{
+			fragReport = 1;
+		}
+		else if (strcmp(argv[i], "--defrag") == 0)
+		{
+			defrag = 1;
+		}
+		else if (strcmp(argv[i], "--fast") == 0)
+		{
+			fastCheck = 1;
+		}
+		else if (strcmp(argv[i], "--direct") == 0)
+		{
+			directIOEnabled = 1;
+		}
+		else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+		{
+			char *end;
+			errno = 0;
+			long jobs = strtol(argv[++i], &end, 10);
+			if (errno != 0 || end == argv[i] || *end != '\0' || jobs < 0 || jobs > MAXWALKJOBS)
+			{
+				printf("Error: --jobs takes a number of threads from 0 to %d, not '%s'.\n", MAXWALKJOBS, argv[i]);
+				return 1;
+			}
+			walkJobs = jobs > 0 ? (int)jobs : (int)sysconf(_SC_NPROCESSORS_ONLN);
+		}
+		else if (argv[i][0] != '-' && image == NULL)
+		{
+			image = argv[i];
+		}
+		else
+		{
+			image = NULL;
+			break;
+		}
+	}
+	if (image == NULL)
 	{
-		printf("Incorrect Usage.\nCorrect Format :   %s <FILE.img>\n", argv[0]);
-		printf("Try Running    :   cp vsfs-\\(backup\\).img vsfs.img && gcc -o checker vsfsck.c && ./checker vsfs.img\n");
+		printf("Incorrect Usage.\nCorrect Format :   %s [--fast] [--discard] [--frag] [--defrag] [--export-map <MAP>] [--progress] [--direct] [--jobs N] [--reference <BACKUP.img>] [--no-undo] <FILE.img>\n", argv[0]);
+		printf("                   %s --undo <FILE.img>\n", argv[0]);
+		printf("Try Running    :   cp vsfs-\\(backup\\).img vsfs.img && gcc -o checker vsfsck.c -pthread && ./checker vsfs.img\n");
+		printf("Or Restore     :   ./checker --reference vsfs-\\(backup\\).img vsfs.img\n");
 		return 1;
 	}
-
-	// ! FARHAN ZARIF
-	if (validateSuperblock(argv[1]) > 0)
+	if (defrag && !useUndoLog)
 	{
-		printf("Superblock validation failed. Fixing errors...\n");
-		fixSuperBlock(argv[1]);
-		printf("---------------------------------\n");
-		printf("\n");
+		// Relocation rewrites data, pointer blocks and inodes one after the other. Without the log
+		// an interrupted run leaves files pointing at blocks that were never written.
+		printf("Error: --defrag needs the undo log, it can not be combined with --no-undo.\n");
+		return 1;
 	}
-	else
+	int isCompressed = isZstdImageFile(image);
+	if (isCompressed)
 	{
-		printf("Superblock validation successful. No errors found.\n");
-		printf("---------------------------------\n");
-		printf("\n");
+#ifndef VSFSCK_WITH_ZSTD
+		printf("Error: %s is zstd compressed. Build with -DVSFSCK_WITH_ZSTD -lzstd, or decompress it first.\n", image);
+		return 1;
+#endif
+		if (rollback)
+		{
+			printf("Error: %s is compressed. Compressed images are never written, so there is nothing to roll back.\n", image);
+			return 1;
+		}
+		printf("%s is compressed. Checking it read-only: repairs are worked out but not written.\n", image);
+		int indexFd = openImage(image, O_RDONLY);
+		if (indexFd < 0)
+		{
+			// Loading the frame index said what is wrong with it
+			return 1;
+		}
+		closeImage(indexFd);
+		if (discard || defrag || reference != NULL)
+		{
+			printf("Note: --discard, --defrag and --reference are ignored for compressed images.\n");
+		}
+		discard = 0;
+		defrag = 0;
+		reference = NULL;
+		useUndoLog = 0;
 	}
-
-	// ! Al- Saihan Tajvi
-	if (validateInodeBitmap(argv[1]) > 0)
+	if (rollback)
 	{
-		printf("Inode bitmap validation failed. Fixing errors...\n");
-		fixInodeBitmap(argv[1]);
-		printf("---------------------------------\n");
-		printf("\n");
+		int rollbackResult = rollbackFromUndoLog(image);
+		if (rollbackResult == 0)
+		{
+			// The image is back to a state no check has vouched for
+			recordCheckResult(image, 0);
+		}
+		return rollbackResult;
 	}
-	else
+	GroupLayout groupLayout;
+	int isGrouped = readGroupLayout(image, &groupLayout);
+	if (isGrouped < 0)
 	{
-		printf("Inode bitmap validation successful. No errors found.\n");
-		printf("---------------------------------\n");
-		printf("\n");
+		printf("Error: %s has a block group extension with an impossible layout (%u groups of %u blocks, %u inodes each).\n",
+			   image, groupLayout.groupCount, groupLayout.blocksPerGroup, groupLayout.inodesPerGroup);
+		return 1;
+	}
+	if (isGrouped)
+	{
+		// Grouped images get the per-group check. The single-volume tools work on blocks 0-63 only
+		if (fastCheck || discard || fragReport || defrag || exportMapPath != NULL || reference != NULL)
+		{
+			printf("Note: --fast, --discard, --frag, --defrag, --export-map and --reference are ignored for images with block groups.\n");
+		}
+		installProgressHandlers(statusIntervalSeconds);
+		if (useUndoLog)
+		{
+			enableUndoLog(image);
+		}
+		int groupedResult = checkGroupedImage(image, &groupLayout);
+		if (isCompressed)
+		{
+			reportCompressedImage();
+		}
+		setCheckPhase("Done");
+		closeUndoLog();
+		arenaFree(&runArena);
+		return undoLogFailed ? 1 : groupedResult;
+	}
+	if (fastCheck && isImageMarkedClean(image))
+	{
+		return 0;
+	}
+	installProgressHandlers(statusIntervalSeconds);
+	if (useUndoLog)
+	{
+		enableUndoLog(image);
 	}
 
-	// ! FARHAN ZARIF
-	if (validateDataBitmap(argv[1]) > 0)
+	if (reference != NULL)
 	{
-		printf("Data bitmap validation failed. Fixing errors...\n");
-		fixDataBitmap(argv[1]);
+		setCheckPhase("Reference Restore");
+		int restored = restoreFromReference(image, reference);
+		if (restored > 0)
+		{
+			atomic_fetch_add_explicit(&repairsQueuedCounter, restored, memory_order_relaxed);
+		}
 		printf("---------------------------------\n");
 		printf("\n");
+		if (isCheckCancelled())
+		{
+			return reportCheckCancelled();
+		}
 	}
-	else
+
+	// Repairs go to an in-memory overlay. Every phase whose inputs a repair touched runs again, until
+	// a round repairs nothing; only then is the result written to the image, in one commit. The
+	// per-phase counts hold what each phase found the last time it ran, totalErrors everything found.
+	int superblockErrors = 0;
+	int inodeBitmapErrors = 0;
+	int dataBitmapErrors = 0;
+	int badPointerErrors = 0;
+	int duplicateErrors = 0;
+	int totalErrors = 0;
+	int round = 1;
+	walkLayouts.isRequested = exportMapPath != NULL;
+	beginRepairOverlay(image);
+	for (; isAnyRepairPhaseDue() && round <= MAXREPAIRROUNDS; round++)
 	{
-		printf("Data bitmap validation successful. No errors found.\n");
-		printf("---------------------------------\n");
-		printf("\n");
+		if (round > 1)
+		{
+			printf("Repair round %d: rechecking what the previous round repaired\n", round);
+			printf("---------------------------------\n");
+			printf("\n");
+		}
+
+		// ! FARHAN ZARIF
+		if (takeRepairPhase(REPAIRPHASESUPERBLOCK))
+		{
+			setCheckPhase("Superblock");
+			superblockErrors = validateSuperblock(image);
+			totalErrors += superblockErrors;
+			if (isCheckCancelled())
+			{
+				return reportCheckCancelled();
+			}
+			if (superblockErrors > 0)
+			{
+				atomic_fetch_add_explicit(&repairsQueuedCounter, superblockErrors, memory_order_relaxed);
+				printf("Superblock validation failed. Fixing errors...\n");
+				fixSuperBlock(image);
+				printf("---------------------------------\n");
+				printf("\n");
+			}
+			else
+			{
+				printf("Superblock validation successful. No errors found.\n");
+				printf("---------------------------------\n");
+				printf("\n");
+			}
+		}
+
+		// ! Al- Saihan Tajvi
+		if (takeRepairPhase(REPAIRPHASEINODEBITMAP))
+		{
+			setCheckPhase("Inode Bitmap");
+			inodeBitmapErrors = validateInodeBitmap(image);
+			totalErrors += inodeBitmapErrors;
+			if (isCheckCancelled())
+			{
+				return reportCheckCancelled();
+			}
+			if (inodeBitmapErrors > 0)
+			{
+				atomic_fetch_add_explicit(&repairsQueuedCounter, inodeBitmapErrors, memory_order_relaxed);
+				printf("Inode bitmap validation failed. Fixing errors...\n");
+				fixInodeBitmap(image);
+				printf("---------------------------------\n");
+				printf("\n");
+			}
+			else
+			{
+				printf("Inode bitmap validation successful. No errors found.\n");
+				printf("---------------------------------\n");
+				printf("\n");
+			}
+		}
+
+		// ! FARHAN ZARIF
+		if (takeRepairPhase(REPAIRPHASEDATABITMAP))
+		{
+			setCheckPhase("Data Bitmap");
+			dataBitmapErrors = validateDataBitmap(image);
+			totalErrors += dataBitmapErrors;
+			if (isCheckCancelled())
+			{
+				return reportCheckCancelled();
+			}
+			if (dataBitmapErrors > 0)
+			{
+				atomic_fetch_add_explicit(&repairsQueuedCounter, dataBitmapErrors, memory_order_relaxed);
+				printf("Data bitmap validation failed. Fixing errors...\n");
+				fixDataBitmap(image);
+				printf("---------------------------------\n");
+				printf("\n");
+			}
+			else
+			{
+				printf("Data bitmap validation successful. No errors found.\n");
+				printf("---------------------------------\n");
+				printf("\n");
+			}
+		}
+
+		// ! Al- Saihan Tajvi
+		if (takeRepairPhase(REPAIRPHASEPOINTERS))
+		{
+			setCheckPhase("Bad Block Pointers");
+			badPointerErrors = validateAndFixBlockPointers(image);
+			totalErrors += badPointerErrors;
+			if (badPointerErrors > 0)
+			{
+				printf("Bad block pointer validation failed.\n");
+			}
+			else if (!isCheckCancelled())
+			{
+				printf("Bad block pointer validation successful. No errors found.\n");
+				printf("---------------------------------\n");
+				printf("\n");
+			}
+			if (isCheckCancelled())
+			{
+				return reportCheckCancelled();
+			}
+		}
+
+		// ! Sadik Mina Dweep
+		if (takeRepairPhase(REPAIRPHASEDUPLICATES))
+		{
+			setCheckPhase("Duplicate Blocks");
+			duplicateErrors = detectAndFixDuplicateBlocks(image);
+			totalErrors += duplicateErrors;
+			if (duplicateErrors > 0)
+			{
+				printf("Duplicate block detection failed. Fixing errors...\n");
+			}
+			else if (!isCheckCancelled())
+			{
+				printf("Duplicate block detection successful. No errors found.\n");
+				printf("---------------------------------\n");
+				printf("\n");
+			}
+			if (isCheckCancelled())
+			{
+				return reportCheckCancelled();
+			}
+		}
+	}
+	int isConverged = !isAnyRepairPhaseDue();
+	if (!isConverged)
+	{
+		printf("Warning: Repairs did not settle after %d rounds. The image may still hold errors, rerun the checker.\n",
+			   MAXREPAIRROUNDS);
+	}
+	setCheckPhase("Commit");
+	if (commitRepairOverlay(image) < 0)
+	{
+		closeUndoLog();
+		arenaFree(&runArena);
+		return 1;
 	}
 
-	// ! Al- Saihan Tajvi
-	if (validateAndFixBlockPointers(argv[1]) > 0)
+	// Only an image every phase last found clean may let later --fast runs skip the full check, or be defragmented
+	int isConsistent = isConverged && superblockErrors + inodeBitmapErrors + dataBitmapErrors + badPointerErrors + duplicateErrors == 0;
+	if (discard)
+	{
+		setCheckPhase("Discard");
+		if (discardFreedBlocks(image) < 0)
+		{
+			closeUndoLog();
+			arenaFree(&runArena);
+			arenaFree(&walkLayouts.arena);
+			return 1;
+		}
+	}
+	if (fragReport)
 	{
-		printf("Bad block pointer validation failed.\n");
+		setCheckPhase("Fragmentation");
+		reportFragmentation(image);
 	}
-	else
+	if (defrag)
 	{
-		printf("Bad block pointer validation successful. No errors found.\n");
+		setCheckPhase("Defragment");
+		if (!isConsistent)
+		{
+			printf("Skipping defragmentation: the repairs did not leave the image consistent.\n");
+		}
+		else
+		{
+			defragmentImage(image);
+		}
 		printf("---------------------------------\n");
 		printf("\n");
 	}
+	if (exportMapPath != NULL)
+	{
+		// Last, so the map describes the image as this run leaves it
+		setCheckPhase("Export Map");
+		exportBlockMap(image, exportMapPath, totalErrors > 0);
+	}
 
-	// ! Sadik Mina Dweep
-	if (detectAndFixDuplicateBlocks(argv[1]) > 0)
+	setCheckPhase("Done");
+	closeUndoLog();
+	if (isCompressed)
 	{
-		printf("Duplicate block detection failed. Fixing errors...\n");
+		// The clean state marker can not be recorded either
+		reportCompressedImage();
 	}
 	else
 	{
-		printf("Duplicate block detection successful. No errors found.\n");
-		printf("---------------------------------\n");
-		printf("\n");
+		recordCheckResult(image, isConsistent);
 	}
-
-	return 0;
+	arenaFree(&runArena);
+	arenaFree(&walkLayouts.arena);
+	return isConsistent ? 0 : 1;
 }
 
 // ! ############################## Farhan Zarif ##############################
 
 // ? ############################## READ BLOCK ##############################
 
-void readBlock(int fd, uint32_t blockNum, unsigned char *buffer)
+// Reads straight from the image file, below the repair overlay
+static void readImageBlock(int fd, uint32_t blockNum, unsigned char *buffer)
 {
-	lseek(fd, blockNum * BLOCKSIZE, SEEK_SET);
-	read(fd, buffer, BLOCKSIZE);
-}
+#ifdef VSFSCK_WITH_ZSTD
+	if (fd >= 0 && fd < MAXIMAGEHANDLES && imageHandles[fd].compressed != NULL)
+	{
+		readCompressedBlock(fd, blockNum, buffer);
+		return;
+	}
+#endif
+	// Holes were located once when the image was opened and read as zeros without any I/O
+	if (isBlockHole(fd, blockNum))
+	{
+		memset(buffer, 0, BLOCKSIZE);
+		return;
+	}
+	if (isDirectImage(fd))
+	{
+		readDirectBlock(fd, blockNum, buffer);
+		return;
+	}
+	ssize_t got = pread(fd, buffer, BLOCKSIZE, (off_t)blockNum * BLOCKSIZE);
+	if (got < BLOCKSIZE)
+	{
+		memset(buffer + (got > 0 ? got : 0), 0, BLOCKSIZE - (got > 0 ? got : 0));
+	}
+}
+
+void readBlock(int fd, uint32_t blockNum, unsigned char *buffer)
+{
+	// Only repaired blocks live in the overlay, everything else is read from the image as usual
+	if (fd >= 0 && fd < MAXIMAGEHANDLES && imageHandles[fd].isOverlaid && isOverlayDirty(blockNum))
+	{
+		readOverlayBlock(fd, blockNum, buffer);
+		return;
+	}
+	readImageBlock(fd, blockNum, buffer);
+}
 
 // ? ############################## WRITE BLOCK ##############################
 
-void writeBlock(int fd, uint32_t blockNum, unsigned char *buffer)
+// Returns -1 when the block could not be written to the image or its undo log, 0 otherwise
+int writeBlock(int fd, uint32_t blockNum, unsigned char *buffer)
 {
-	lseek(fd, blockNum * BLOCKSIZE, SEEK_SET);
-	write(fd, buffer, BLOCKSIZE);
+	// Repairs land in the overlay, the disk only sees the final state when it is committed
+	if (fd >= 0 && fd < MAXIMAGEHANDLES && imageHandles[fd].isOverlaid && blockNum < TOTALBLOCKS)
+	{
+		writeOverlayBlock(fd, blockNum, buffer);
+		return 0;
+	}
+
+	if (fd >= 0 && fd < MAXIMAGEHANDLES && imageHandles[fd].compressed != NULL)
+	{
+		// Compressed images are only read, the repair is counted and reported at the end
+		unwrittenRepairBlocks++;
+		return 0;
+	}
+
+	// The original contents are durable in the undo log before the block is overwritten, or the
+	// block is not overwritten at all
+	if (logBlockForUndo(fd, blockNum) != 0)
+	{
+		return -1;
+	}
+	int result = 0;
+	if (isDirectImage(fd))
+	{
+		result = writeDirectBlock(fd, blockNum, buffer);
+	}
+	else if (pwrite(fd, buffer, BLOCKSIZE, (off_t)blockNum * BLOCKSIZE) != BLOCKSIZE)
+	{
+		result = -1;
+	}
+	if (undoLogEnabled && fdatasync(fd) != 0)
+	{
+		result = -1;
+	}
+	if (result != 0)
+	{
+		return -1;
+	}
+
+	// The block is backed by data now
+	SparseImage *sparse = (fd >= 0 && fd < MAXIMAGEHANDLES) ? imageHandles[fd].sparse : NULL;
+	if (sparse != NULL && sparse->holeMap != NULL && blockNum < sparse->numBlocks)
+	{
+		removeBit(sparse->holeMap, blockNum);
+	}
+	return 0;
 }
 
 // ? ############################## BIT CHECK ##############################
@@ -239,9 +1239,10 @@ void removeBit(unsigned char *bitMap, int bitIndex)
 
 int validateSuperblock(char *image)
 {
-	int fd = open(image, O_RDONLY);
-	Superblock *sbPTR = (Superblock *)malloc(sizeof(Superblock));
-	readBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+	int fd = openImage(image, O_RDONLY);
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
 
 	printf("Validating superblock for image: %s\n", image);
 	printf("---------------------------------\n");
@@ -294,8 +1295,8 @@ int validateSuperblock(char *image)
 	}
 	printf("---------------------------------\n");
 
-	close(fd);
-	free(sbPTR);
+	closeImage(fd);
+	arenaRelease(&runArena, mark);
 	return error;
 }
 
@@ -303,8 +1304,10 @@ int validateSuperblock(char *image)
 
 void fixSuperBlock(char *image)
 {
-	int fd = open(image, O_WRONLY);
-	Superblock *sbPTR = (Superblock *)malloc(sizeof(Superblock));
+	int fd = openImage(image, O_RDWR); // Read access so the old superblock can go to the undo log
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	memset(sbPTR, 0, sizeof(Superblock));
 	sbPTR->magicByte = MAGICNUM;
 	sbPTR->blockSize = BLOCKSIZE;
 	sbPTR->totalBlocks = TOTALBLOCKS;
@@ -315,35 +1318,117 @@ void fixSuperBlock(char *image)
 	sbPTR->inodeSize = INODESIZE;
 	sbPTR->inodeCount = INODECOUNT;
 
-	writeBlock(fd, 0, (unsigned char *)sbPTR);
-	close(fd);
-	free(sbPTR);
-	printf("Fixed all the errors regarding Superblock. Please rerun the checker to ensure!\n");
+	writeSuperblock(fd, sbPTR);
+	closeImage(fd);
+	arenaRelease(&runArena, mark);
+	printf("Fixed all the errors regarding Superblock.\n");
 }
 
 // ? ############################## MARK DATA BLOCK REFERENCE ##############################
 
-void markDataBlockReference(uint32_t inodeNum, uint32_t dataBlockAddress, int isCurrentInodeValid)
+// Logical file blocks covered by one pointer at the given tree level (level 0 is a data pointer)
+static uint64_t logicalSpan(int level)
 {
-	if (dataBlockAddress == 0)
+	uint64_t span = 1;
+	for (int i = 0; i < level; i++)
+	{
+		span *= POINTERSPBLOCK;
+	}
+	return span;
+}
+
+// Walkers on the pool share the state table, so their marks are atomic
+static void markWalkState(WalkContext *walk, int plane, uint32_t blockNum)
+{
+	if (walk->worker != NULL)
+	{
+		__atomic_fetch_or(&blockState[plane][blockNum / 64], (uint64_t)1 << (blockNum % 64), __ATOMIC_RELAXED);
+	}
+	else
+	{
+		setBlockState(plane, blockNum);
+	}
+}
+
+// On the pool the blocks of one tree are met by several workers in no particular order. Each worker
+// keeps them with their inode, the join files them and restores the pre-order.
+static void recordWalkLayout(WalkContext *walk, uint64_t logical, uint32_t physical, int level)
+{
+	if (walk->layout == NULL || !walk->isInodeValid)
 	{
 		return;
 	}
-	if (dataBlockAddress < FIRSTDATABLOCKNUM || dataBlockAddress > LASTDATABLOCKNUM)
+	if (walk->worker == NULL)
+	{
+		recordBlockLayout(walk->layoutArena, walk->layout, logical, physical, level);
+		return;
+	}
+
+	WalkWorker *worker = walk->worker;
+	if (worker->layoutCount == worker->layoutCapacity)
+	{
+		worker->layoutCapacity = worker->layoutCapacity ? worker->layoutCapacity * 2 : 64;
+		worker->layoutEntries = realloc(worker->layoutEntries, worker->layoutCapacity * sizeof(WalkLayoutEntry));
+	}
+	WalkLayoutEntry *recorded = &worker->layoutEntries[worker->layoutCount++];
+	recorded->inodeNum = walk->inodeNum;
+	recorded->entry.logical = logical;
+	recorded->entry.physical = physical;
+	recorded->entry.level = (uint32_t)level;
+}
+
+// Records a data block already known to lie in the data region
+static void noteDataBlock(WalkContext *walk, uint32_t dataBlockAddress, uint64_t logicalIndex)
+{
+	if (isBlockHole(walk->fd, dataBlockAddress))
+	{
+		walkReport(walk, logicalIndex, "Warning: Inode %u data block %u lies in a hole of the image file. It was never written.\n", walk->inodeNum, dataBlockAddress);
+	}
+	recordWalkLayout(walk, logicalIndex, dataBlockAddress, 0);
+	markWalkState(walk, PLANEREFANY, dataBlockAddress);
+	if (walk->isInodeValid)
+	{
+		markWalkState(walk, PLANEREFVALID, dataBlockAddress);
+	}
+}
+
+void markDataBlockReference(WalkContext *walk, uint32_t dataBlockAddress, uint64_t logicalIndex)
+{
+	if (dataBlockAddress == 0)
 	{
-		printf("Error: Bad data block pointer. Address: %u. Out of valid data range.\n", dataBlockAddress);
 		return;
 	}
-	referencedByAnyInode[dataBlockAddress] = 1;
-	if (isCurrentInodeValid)
+	if (dataBlockAddress < FIRSTDATABLOCKNUM || dataBlockAddress > LASTDATABLOCKNUM)
 	{
-		referencedByValidInode[dataBlockAddress] = 1;
+		walkReport(walk, logicalIndex, "Error: Bad data block pointer. Address: %u. Out of valid data range.\n", dataBlockAddress);
+		return;
 	}
+	noteDataBlock(walk, dataBlockAddress, logicalIndex);
 }
 
 // ? ############################## PROCESS INDIRECT POINTERS ##############################
 
-void processIndirectBPointers(int fd, uint32_t inodeNum, uint32_t indirectBlockAddress, int level, int isCurrentInodeValid)
+// Enters a pointer block already known to lie in the data region
+static void enterPointerBlock(WalkContext *walk, uint32_t indirectBlockAddress, int level, uint64_t logicalBase)
+{
+	if (isBlockHole(walk->fd, indirectBlockAddress))
+	{
+		walkReport(walk, logicalBase, "Warning: Inode %u indirect block %u lies in a hole of the image file. It was never written.\n", walk->inodeNum, indirectBlockAddress);
+	}
+	recordWalkLayout(walk, logicalBase, indirectBlockAddress, level);
+
+	// The pointer block itself is owned by the inode just like the data it points to
+	markWalkState(walk, PLANEPOINTERBLOCK, indirectBlockAddress);
+	markWalkState(walk, PLANEREFANY, indirectBlockAddress);
+	if (walk->isInodeValid)
+	{
+		markWalkState(walk, PLANEREFVALID, indirectBlockAddress);
+	}
+
+	walkPointerRange(walk, indirectBlockAddress, level, logicalBase, 0, POINTERSPBLOCK);
+}
+
+void processIndirectBPointers(WalkContext *walk, uint32_t indirectBlockAddress, int level, uint64_t logicalBase)
 {
 	if (indirectBlockAddress == 0)
 	{
@@ -351,57 +1436,93 @@ void processIndirectBPointers(int fd, uint32_t inodeNum, uint32_t indirectBlockA
 	}
 	if (indirectBlockAddress < FIRSTDATABLOCKNUM || indirectBlockAddress > LASTDATABLOCKNUM)
 	{
-		printf("Error: Bad data block pointer. Address: %u. Out of valid data range.\n", indirectBlockAddress);
+		walkReport(walk, logicalBase, "Error: Bad data block pointer. Address: %u. Out of valid data range.\n", indirectBlockAddress);
 		return;
 	}
+	enterPointerBlock(walk, indirectBlockAddress, level, logicalBase);
+}
 
-	uint32_t *pointers = (uint32_t *)malloc(BLOCKSIZE);
-	readBlock(fd, indirectBlockAddress, (unsigned char *)pointers);
-	for (int i = 0; i < POINTERSPBLOCK; i++)
+// ? ############################## WALK POINTER RANGE ##############################
+
+// Visits children [first, end) of one pointer block. On the pool, a large range of an upper tree
+// level is halved repeatedly and the upper halves are left on this worker's deque, where idle
+// workers steal them. The lower half, and with it the first child, always stays with this worker.
+void walkPointerRange(WalkContext *walk, uint32_t indirectBlockAddress, int level, uint64_t logicalBase, uint32_t first, uint32_t end)
+{
+	// Without the pool nothing else polls while one large tree is walked. A cancelled walk leaves
+	// the rest of the tree unvisited, its callers drop what it collected.
+	if (walk->worker == NULL && pollCheckStatus())
 	{
-		uint32_t nextAddress = pointers[i];
-		if (nextAddress == 0)
-		{
-			continue;
-		}
-		if (level == 1)
-		{
-			markDataBlockReference(inodeNum, nextAddress, isCurrentInodeValid);
-		}
-		else
+		return;
+	}
+	while (walk->worker != NULL && level > 1 && end - first > WALKSPLITGRAIN)
+	{
+		uint32_t middle = first + (end - first) / 2;
+		WalkTask task = {WALKTASKRANGE, walk->inodeNum, walk->isInodeValid, NULL,
+						 indirectBlockAddress, level, logicalBase, middle, end};
+		pushWalkTask(walk->worker, &task);
+		end = middle;
+	}
+
+	uint32_t *pointers = (uint32_t *)(walk->worker != NULL ? walk->worker->scratch + (level * BLOCKSIZE) : walkerScratchBlock(level));
+	readWordBlock(walk->fd, indirectBlockAddress, pointers);
+	notePointerBlockVisited();
+
+	// The block is range-checked as a whole, the loop then only visits non-zero entries of the range
+	PointerBlockClass cls;
+	classifyPointerBlock(pointers, &cls);
+	uint64_t childSpan = logicalSpan(level - 1);
+	for (uint32_t w = first / 64; first < end && w <= (end - 1) / 64; w++)
+	{
+		uint64_t present = ~cls.zero[w] & blockRangeMask(w, first, end - 1);
+		while (present)
 		{
-			processIndirectBPointers(fd, inodeNum, nextAddress, level - 1, isCurrentInodeValid);
+			uint32_t i = (w * 64) + __builtin_ctzll(present);
+			present &= present - 1;
+			uint64_t childLogical = logicalBase + (i * childSpan);
+			if ((cls.bad[w] >> (i % 64)) & 1)
+			{
+				walkReport(walk, childLogical, "Error: Bad data block pointer. Address: %u. Out of valid data range.\n", pointers[i]);
+			}
+			else if (level == 1)
+			{
+				noteDataBlock(walk, pointers[i], childLogical);
+			}
+			else
+			{
+				enterPointerBlock(walk, pointers[i], level - 1, childLogical);
+			}
 		}
 	}
-	free(pointers);
 }
 
 // ? ############################## COLLECT BLOCKS FOR INODE ##############################
 
-void collectBlocksForInode(int fd, uint32_t inodeNum, Inode *currentInode)
+void collectBlocksForInode(WalkContext *walk, Inode *currentInode)
 {
-	int isInodeValid = (currentInode->numHardLinks > 0 && currentInode->deletionTime == 0);
-	if (currentInode->numDataBlocksAllocated == 0 && !isInodeValid)
+	walk->isInodeValid = (currentInode->numHardLinks > 0 && currentInode->deletionTime == 0);
+	if (currentInode->numDataBlocksAllocated == 0 && !walk->isInodeValid)
 	{
 		return;
 	}
 
 	for (int i = 0; i < 12; i++)
 	{
-		markDataBlockReference(inodeNum, currentInode->directPointer[i], isInodeValid);
+		markDataBlockReference(walk, currentInode->directPointer[i], i);
 	}
 
-	if (currentInode->singleIndirectPointer != 0)
-	{
-		processIndirectBPointers(fd, inodeNum, currentInode->singleIndirectPointer, 1, isInodeValid);
-	}
-	if (currentInode->doubleIndirectPointer != 0)
-	{
-		processIndirectBPointers(fd, inodeNum, currentInode->doubleIndirectPointer, 2, isInodeValid);
-	}
-	if (currentInode->tripleIndirectPointer != 0)
+	// Logical block numbers continue from the direct pointers through the single, double and triple trees
+	uint32_t roots[3] = {currentInode->singleIndirectPointer,
+						 currentInode->doubleIndirectPointer,
+						 currentInode->tripleIndirectPointer};
+	uint64_t logicalBase = 12;
+	for (int level = 1; level <= MAXTREEDEPTH; level++)
 	{
-		processIndirectBPointers(fd, inodeNum, currentInode->tripleIndirectPointer, 3, isInodeValid);
+		if (roots[level - 1] != 0)
+		{
+			processIndirectBPointers(walk, roots[level - 1], level, logicalBase);
+		}
+		logicalBase += logicalSpan(level);
 	}
 }
 
@@ -409,9 +1530,10 @@ void collectBlocksForInode(int fd, uint32_t inodeNum, Inode *currentInode)
 
 int validateDataBitmap(char *image)
 {
-	int fd = open(image, O_RDONLY);
-	Superblock *sbPTR = (Superblock *)malloc(sizeof(Superblock));
-	readBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+	int fd = openImage(image, O_RDONLY);
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
 	printf("Validating Data Bitmap\n");
 	printf("---------------------------------\n");
 
@@ -425,48 +1547,116 @@ int validateDataBitmap(char *image)
 	Inode *currentInodePTR;
 	uint32_t inodesPerBlock = sbPTR->blockSize / sbPTR->inodeSize;
 
+	clearBlockPlane(PLANEREFVALID);
+	clearBlockPlane(PLANEREFANY);
+	clearBlockPlane(PLANEPOINTERBLOCK);
+	loadBitmapPlane(PLANEMARKED, dataBitmap, sbPTR->firstDataBlock, LASTDATABLOCKNUM);
+
+	// The walk lays out the valid inodes on the way, --export-map then needs no walk of its own
+	InodeLayout *layouts = NULL;
+	if (walkLayouts.isRequested)
+	{
+		arenaRelease(&walkLayouts.arena, (ArenaMark){NULL, 0});
+		memset(walkLayouts.inodes, 0, sizeof(walkLayouts.inodes));
+		walkLayouts.validCount = 0;
+		walkLayouts.isCurrent = 0;
+		layouts = walkLayouts.inodes;
+	}
+
+	Inode *walkInodes = NULL;
+	uint32_t *walkInodeNums = NULL;
+	uint32_t walkCount = 0;
+	if (walkJobs > 1)
+	{
+		walkInodes = arenaAlloc(&runArena, INODETABNUMBLOCKS * inodesPerBlock * sizeof(Inode), sizeof(uint64_t));
+		walkInodeNums = arenaAlloc(&runArena, INODETABNUMBLOCKS * inodesPerBlock * sizeof(uint32_t), sizeof(uint32_t));
+	}
+
 	for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
 	{
+		if (pollCheckStatus())
+		{
+			arenaRelease(&runArena, mark);
+			closeImage(fd);
+			return error;
+		}
 		uint32_t currentInodeTableBlockNum = sbPTR->itabStartBlock + i;
-		readBlock(fd, currentInodeTableBlockNum, blockBuffer);
-		for (uint32_t j = 0; j < inodesPerBlock; j++)
+		readInodeBlock(fd, currentInodeTableBlockNum, blockBuffer);
+
+		// Only valid inodes and deleted ones still holding blocks can reference anything
+		InodeBlockMasks masks;
+		classifyInodeBlock(blockBuffer, inodesPerBlock, sbPTR->inodeSize, &masks);
+		uint64_t pending = masks.valid | masks.deletedAllocated;
+		while (pending)
 		{
+			uint32_t j = __builtin_ctzll(pending);
+			pending &= pending - 1;
 			uint32_t currentInodeNum = (i * inodesPerBlock) + j;
 			currentInodePTR = (Inode *)((blockBuffer + (j * sbPTR->inodeSize)));
-			collectBlocksForInode(fd, currentInodeNum, currentInodePTR);
+			if (layouts != NULL && ((masks.valid >> j) & 1))
+			{
+				walkLayouts.validInodes[walkLayouts.validCount++] = currentInodeNum;
+			}
+			if (walkJobs > 1)
+			{
+				// Walked on the pool once the table is read, keep a copy of the inode until then
+				memcpy(&walkInodes[walkCount], currentInodePTR, sizeof(Inode));
+				walkInodeNums[walkCount++] = currentInodeNum;
+				continue;
+			}
+			WalkContext walk = {.fd = fd,
+								.inodeNum = currentInodeNum,
+								.layout = layouts != NULL ? &layouts[currentInodeNum] : NULL,
+								.layoutArena = &walkLayouts.arena};
+			collectBlocksForInode(&walk, currentInodePTR);
 		}
+		noteInodesScanned(inodesPerBlock);
+	}
+	if (walkCount > 0)
+	{
+		collectBlocksInParallel(fd, walkInodes, walkInodeNums, walkCount, walkJobs, layouts, &walkLayouts.arena);
+	}
+	walkLayouts.isCurrent = layouts != NULL && !isCheckCancelled();
+	if (isCheckCancelled())
+	{
+		// The walk stopped part way, the rules would report blocks it never reached
+		arenaRelease(&runArena, mark);
+		closeImage(fd);
+		return error;
 	}
 
+	// Both rules count valid inodes only, like the block group check. A block only a deleted inode
+	// still claims is free, and Rule B must not mark again what the Rule A repair freed.
 	printf("Checking Rule A: Bitmap used and referenced by valid inode\n");
-	for (uint32_t i = 0; i < NUMDATABLOCKSFS; i++)
+	for (uint32_t w = 0; w < BLOCKSTATEWORDS; w++)
 	{
-		uint32_t actualBlockNum = sbPTR->firstDataBlock + i;
-		if (bitCheck(dataBitmap, i))
+		uint64_t violations = blockState[PLANEMARKED][w] & ~blockState[PLANEREFVALID][w] &
+							  blockRangeMask(w, sbPTR->firstDataBlock, LASTDATABLOCKNUM);
+		while (violations)
 		{
-			if (!referencedByValidInode[actualBlockNum])
-			{
-				printf("Error Rule a: Block %u (bitmap bit %u) is Used in bitmap, but not referenced by any valid inode.\n", actualBlockNum, i);
-				error++;
-			}
+			uint32_t actualBlockNum = (w * 64) + __builtin_ctzll(violations);
+			violations &= violations - 1;
+			printf("Error Rule a: Block %u (bitmap bit %u) is Used in bitmap, but not referenced by any valid inode.\n", actualBlockNum, actualBlockNum - sbPTR->firstDataBlock);
+			error++;
 		}
 	}
 
-	printf("Checking Rule B: Referenced by any inode and bitmap used\n");
-	for (uint32_t i = sbPTR->firstDataBlock; i <= LASTDATABLOCKNUM; i++)
+	printf("Checking Rule B: Referenced by valid inode and bitmap used\n");
+	for (uint32_t w = 0; w < BLOCKSTATEWORDS; w++)
 	{
-		if (referencedByAnyInode[i])
+		uint64_t violations = blockState[PLANEREFVALID][w] & ~blockState[PLANEMARKED][w] &
+							  blockRangeMask(w, sbPTR->firstDataBlock, LASTDATABLOCKNUM);
+		while (violations)
 		{
-			int bitmapBitIndex = i - sbPTR->firstDataBlock;
-			if (!bitCheck(dataBitmap, bitmapBitIndex))
-			{
-				printf("Error Rule b: Block %u (bitmap bit %u) is referenced by an inode, but not marked used in data bitmap.\n", i, bitmapBitIndex);
-				error++;
-			}
+			uint32_t actualBlockNum = (w * 64) + __builtin_ctzll(violations);
+			violations &= violations - 1;
+			printf("Error Rule b: Block %u (bitmap bit %u) is referenced by a valid inode, but not marked used in data bitmap.\n", actualBlockNum, actualBlockNum - sbPTR->firstDataBlock);
+			error++;
 		}
 	}
 	printf("---------------------------------\n");
-	free(sbPTR);
-	close(fd);
+	arenaRelease(&runArena, mark);
+	closeImage(fd);
 	return error;
 }
 
@@ -474,36 +1664,31 @@ int validateDataBitmap(char *image)
 
 void fixDataBitmap(char *image)
 {
-	int fd = open(image, O_RDWR);
-	Superblock *sbPTR = (Superblock *)malloc(sizeof(Superblock));
-	readBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+	int fd = openImage(image, O_RDWR);
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
 
 	unsigned char dataBitmap[BLOCKSIZE];
 	readBlock(fd, sbPTR->dbimBlock, dataBitmap);
 
-	for (uint32_t i = 0; i < NUMDATABLOCKSFS; i++)
+	// A block is used exactly when a valid inode references it, the same set both rules check
+	loadBitmapPlane(PLANEMARKED, dataBitmap, sbPTR->firstDataBlock, LASTDATABLOCKNUM);
+	for (uint32_t w = 0; w < BLOCKSTATEWORDS; w++)
 	{
-		uint32_t actualBlockNum = sbPTR->firstDataBlock + i;
-		if (bitCheck(dataBitmap, i))
-		{
-			if (!referencedByValidInode[actualBlockNum])
-			{
-				removeBit(dataBitmap, i);
-			}
-		}
-		else
-		{
-			if (referencedByAnyInode[actualBlockNum])
-			{
-				setBit(dataBitmap, i);
-			}
-		}
+		uint64_t marked = blockState[PLANEMARKED][w];
+		uint64_t fixedWord = blockState[PLANEREFVALID][w];
+		uint64_t range = blockRangeMask(w, sbPTR->firstDataBlock, LASTDATABLOCKNUM);
+		blockState[PLANEMARKED][w] = (fixedWord & range) | (marked & ~range);
+		// Remembered for --discard, which releases their storage once the run is over
+		blockState[PLANEFREED][w] |= marked & ~fixedWord & range;
 	}
+	storeBitmapPlane(PLANEMARKED, dataBitmap, sbPTR->firstDataBlock, LASTDATABLOCKNUM);
 
 	writeBlock(fd, sbPTR->dbimBlock, dataBitmap);
-	free(sbPTR);
-	close(fd);
-	printf("Fixed all the errors regarding Data Bitmap. Please rerun the checker to ensure!\n");
+	arenaRelease(&runArena, mark);
+	closeImage(fd);
+	printf("Fixed all the errors regarding Data Bitmap.\n");
 }
 
 // ! ############################## Al- Saihan Tajvi ##############################
@@ -512,9 +1697,10 @@ void fixDataBitmap(char *image)
 
 int validateInodeBitmap(char *image)
 {
-	int fd = open(image, O_RDONLY);
-	Superblock *sbPTR = (Superblock *)malloc(sizeof(Superblock));
-	readBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+	int fd = openImage(image, O_RDONLY);
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
 	printf("Validating Inode Bitmap\n");
 	printf("---------------------------------\n");
 
@@ -531,15 +1717,26 @@ int validateInodeBitmap(char *image)
 	printf("Check Rule B: Every such inode is marked as used in the bitmap\n");
 	for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
 	{
+		if (pollCheckStatus())
+		{
+			break;
+		}
 		uint32_t currentInodeTableBlockNum = sbPTR->itabStartBlock + i;
-		readBlock(fd, currentInodeTableBlockNum, blockBuffer);
-
-		for (uint32_t j = 0; j < inodesPerBlock; j++)
+		readInodeBlock(fd, currentInodeTableBlockNum, blockBuffer);
+		noteInodesScanned(inodesPerBlock);
+
+		// Only slots where the bitmap disagrees with the valid mask need a closer look
+		InodeBlockMasks masks;
+		classifyInodeBlock(blockBuffer, inodesPerBlock, sbPTR->inodeSize, &masks);
+		uint64_t mismatched = masks.valid ^ extractBitmapBits(inodeBitmap, i * inodesPerBlock, inodesPerBlock);
+		while (mismatched)
 		{
+			uint32_t j = __builtin_ctzll(mismatched);
+			mismatched &= mismatched - 1;
 			uint32_t currentInodeNum = (i * inodesPerBlock) + j;
 			currentInodePTR = (Inode *)((blockBuffer + (j * sbPTR->inodeSize)));
 
-			int isInodeValid = (currentInodePTR->numHardLinks > 0 && currentInodePTR->deletionTime == 0);
+			int isInodeValid = (masks.valid >> j) & 1;
 			int isMarkedInBitmap = bitCheck(inodeBitmap, currentInodeNum);
 
 			if (isMarkedInBitmap && !isInodeValid)
@@ -559,8 +1756,8 @@ int validateInodeBitmap(char *image)
 	}
 
 	printf("---------------------------------\n");
-	free(sbPTR);
-	close(fd);
+	arenaRelease(&runArena, mark);
+	closeImage(fd);
 	return error;
 }
 
@@ -568,29 +1765,33 @@ int validateInodeBitmap(char *image)
 
 void fixInodeBitmap(char *image)
 {
-	int fd = open(image, O_RDWR);
-	Superblock *sbPTR = (Superblock *)malloc(sizeof(Superblock));
-	readBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+	int fd = openImage(image, O_RDWR);
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
 
 	unsigned char inodeBitmap[BLOCKSIZE];
 	readBlock(fd, sbPTR->ibimBlock, inodeBitmap);
 
 	// Scan all inodes to fix both types of errors
 	unsigned char blockBuffer[BLOCKSIZE];
-	Inode *currentInodePTR;
 	uint32_t inodesPerBlock = sbPTR->blockSize / sbPTR->inodeSize;
 
 	for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
 	{
 		uint32_t currentInodeTableBlockNum = sbPTR->itabStartBlock + i;
-		readBlock(fd, currentInodeTableBlockNum, blockBuffer);
+		readInodeBlock(fd, currentInodeTableBlockNum, blockBuffer);
 
-		for (uint32_t j = 0; j < inodesPerBlock; j++)
+		InodeBlockMasks masks;
+		classifyInodeBlock(blockBuffer, inodesPerBlock, sbPTR->inodeSize, &masks);
+		uint64_t mismatched = masks.valid ^ extractBitmapBits(inodeBitmap, i * inodesPerBlock, inodesPerBlock);
+		while (mismatched)
 		{
+			uint32_t j = __builtin_ctzll(mismatched);
+			mismatched &= mismatched - 1;
 			uint32_t currentInodeNum = (i * inodesPerBlock) + j;
-			currentInodePTR = (Inode *)((blockBuffer + (j * sbPTR->inodeSize)));
 
-			int isInodeValid = (currentInodePTR->numHardLinks > 0 && currentInodePTR->deletionTime == 0);
+			int isInodeValid = (masks.valid >> j) & 1;
 			int isMarkedInBitmap = bitCheck(inodeBitmap, currentInodeNum);
 
 			// Fix Rule a:
@@ -610,18 +1811,47 @@ void fixInodeBitmap(char *image)
 	// final writing of the inode bitmap
 	writeBlock(fd, sbPTR->ibimBlock, inodeBitmap);
 
-	free(sbPTR);
-	close(fd);
-	printf("Fixed all inode bitmap errors. Please rerun the checker to verify.\n");
+	arenaRelease(&runArena, mark);
+	closeImage(fd);
+	printf("Fixed all inode bitmap errors.\n");
+}
+
+// ? ############################## NULL BAD POINTERS ##############################
+
+// Nulls and reports every entry of a leaf pointer block that points outside the data region. The
+// whole block is classified first, so a block without bad entries costs no per-entry branches.
+static int nullBadPointers(uint32_t *pointers, uint32_t inodeNum, const char *kind)
+{
+	PointerBlockClass cls;
+	if (classifyPointerBlock(pointers, &cls) == 0)
+	{
+		return 0;
+	}
+
+	int nulled = 0;
+	for (uint32_t w = 0; w < POINTERCLASSWORDS; w++)
+	{
+		uint64_t bad = cls.bad[w];
+		while (bad)
+		{
+			uint32_t k = (w * 64) + __builtin_ctzll(bad);
+			bad &= bad - 1;
+			printf("Error: Inode %u has bad %s pointer %u (block %u). Fixing by nulling pointer.\n", inodeNum, kind, k, pointers[k]);
+			pointers[k] = 0;
+			nulled++;
+		}
+	}
+	return nulled;
 }
 
 // ? ############################## BAD BLOCK CHECKER + FIXER ##############################
 
 int validateAndFixBlockPointers(char *image)
 {
-	int fd = open(image, O_RDWR); // Need read-write for fixing
-	Superblock *sbPTR = (Superblock *)malloc(sizeof(Superblock));
-	readBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+	int fd = openImage(image, O_RDWR); // Need read-write for fixing
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
 
 	printf("Checking and fixing bad block pointers\n");
 	printf("---------------------------------\n");
@@ -635,11 +1865,23 @@ int validateAndFixBlockPointers(char *image)
 	// ? Scan all inodes in the inode table
 	for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
 	{
+		// ? Once a pointer has been nulled the pass runs to completion so no half-fixed image is left
+		if (pollCheckStatus() && fixed == 0)
+		{
+			break;
+		}
 		uint32_t currentInodeTableBlockNum = sbPTR->itabStartBlock + i;
-		readBlock(fd, currentInodeTableBlockNum, blockBuffer);
-
-		for (uint32_t j = 0; j < inodesPerBlock; j++)
+		readInodeBlock(fd, currentInodeTableBlockNum, blockBuffer);
+		noteInodesScanned(inodesPerBlock);
+
+		// ? An all-zero inode has no pointers to check
+		InodeBlockMasks masks;
+		classifyInodeBlock(blockBuffer, inodesPerBlock, sbPTR->inodeSize, &masks);
+		uint64_t pending = masks.nonEmpty;
+		while (pending)
 		{
+			uint32_t j = __builtin_ctzll(pending);
+			pending &= pending - 1;
 			uint32_t currentInodeNum = (i * inodesPerBlock) + j;
 			currentInodePTR = (Inode *)((blockBuffer + (j * sbPTR->inodeSize)));
 			int inodeModified = 0;
@@ -675,27 +1917,16 @@ int validateAndFixBlockPointers(char *image)
 				else
 				{
 					// ? Check pointers in the indirect block
-					uint32_t indirectBlock[POINTERSPBLOCK];
-					readBlock(fd, currentInodePTR->singleIndirectPointer, (unsigned char *)indirectBlock);
-					int blockModified = 0;
-
-					for (int k = 0; k < POINTERSPBLOCK; k++)
-					{
-						if (indirectBlock[k] != 0 &&
-							(indirectBlock[k] < FIRSTDATABLOCKNUM || indirectBlock[k] > LASTDATABLOCKNUM))
-						{
-							printf("Error: Inode %u has bad single-indirect pointer %u (block %u). Fixing by nulling pointer.\n",
-								   currentInodeNum, k, indirectBlock[k]);
-							indirectBlock[k] = 0;
-							blockModified = 1;
-							error++;
-							fixed++;
-						}
-					}
+					uint32_t *indirectBlock = (uint32_t *)walkerScratchBlock(1);
+					readWordBlock(fd, currentInodePTR->singleIndirectPointer, indirectBlock);
+					notePointerBlockVisited();
 
-					if (blockModified)
+					int nulled = nullBadPointers(indirectBlock, currentInodeNum, "single-indirect");
+					if (nulled > 0)
 					{
-						writeBlock(fd, currentInodePTR->singleIndirectPointer, (unsigned char *)indirectBlock);
+						error += nulled;
+						fixed += nulled;
+						writeWordBlock(fd, currentInodePTR->singleIndirectPointer, indirectBlock);
 					}
 				}
 			}
@@ -716,15 +1947,21 @@ int validateAndFixBlockPointers(char *image)
 				else
 				{
 					// ? Check second level pointers
-					uint32_t firstLevel[POINTERSPBLOCK];
-					readBlock(fd, currentInodePTR->doubleIndirectPointer, (unsigned char *)firstLevel);
+					uint32_t *firstLevel = (uint32_t *)walkerScratchBlock(2);
+					readWordBlock(fd, currentInodePTR->doubleIndirectPointer, firstLevel);
+					notePointerBlockVisited();
 					int firstLevelModified = 0;
 
-					for (int k = 0; k < POINTERSPBLOCK; k++)
+					PointerBlockClass firstClass;
+					classifyPointerBlock(firstLevel, &firstClass);
+					for (uint32_t w = 0; w < POINTERCLASSWORDS; w++)
 					{
-						if (firstLevel[k] != 0)
+						uint64_t present = ~firstClass.zero[w];
+						while (present)
 						{
-							if (firstLevel[k] < FIRSTDATABLOCKNUM || firstLevel[k] > LASTDATABLOCKNUM)
+							uint32_t k = (w * 64) + __builtin_ctzll(present);
+							present &= present - 1;
+							if ((firstClass.bad[w] >> (k % 64)) & 1)
 							{
 								printf("Error: Inode %u has bad double-indirect first-level pointer %u (block %u). Fixing by nulling pointer.\n",
 									   currentInodeNum, k, firstLevel[k]);
@@ -736,27 +1973,16 @@ int validateAndFixBlockPointers(char *image)
 							else
 							{
 								// ? Check third level pointers
-								uint32_t secondLevel[POINTERSPBLOCK];
-								readBlock(fd, firstLevel[k], (unsigned char *)secondLevel);
-								int secondLevelModified = 0;
-
-								for (int l = 0; l < POINTERSPBLOCK; l++)
-								{
-									if (secondLevel[l] != 0 &&
-										(secondLevel[l] < FIRSTDATABLOCKNUM || secondLevel[l] > LASTDATABLOCKNUM))
-									{
-										printf("Error: Inode %u has bad double-indirect second-level pointer %u (block %u). Fixing by nulling pointer.\n",
-											   currentInodeNum, l, secondLevel[l]);
-										secondLevel[l] = 0;
-										secondLevelModified = 1;
-										error++;
-										fixed++;
-									}
-								}
+								uint32_t *secondLevel = (uint32_t *)walkerScratchBlock(1);
+								readWordBlock(fd, firstLevel[k], secondLevel);
+								notePointerBlockVisited();
 
-								if (secondLevelModified)
+								int nulled = nullBadPointers(secondLevel, currentInodeNum, "double-indirect second-level");
+								if (nulled > 0)
 								{
-									writeBlock(fd, firstLevel[k], (unsigned char *)secondLevel);
+									error += nulled;
+									fixed += nulled;
+									writeWordBlock(fd, firstLevel[k], secondLevel);
 								}
 							}
 						}
@@ -764,7 +1990,7 @@ int validateAndFixBlockPointers(char *image)
 
 					if (firstLevelModified)
 					{
-						writeBlock(fd, currentInodePTR->doubleIndirectPointer, (unsigned char *)firstLevel);
+						writeWordBlock(fd, currentInodePTR->doubleIndirectPointer, firstLevel);
 					}
 				}
 			}
@@ -785,15 +2011,21 @@ int validateAndFixBlockPointers(char *image)
 				else
 				{
 					// ? Check second level pointers
-					uint32_t firstLevel[POINTERSPBLOCK];
-					readBlock(fd, currentInodePTR->tripleIndirectPointer, (unsigned char *)firstLevel);
+					uint32_t *firstLevel = (uint32_t *)walkerScratchBlock(3);
+					readWordBlock(fd, currentInodePTR->tripleIndirectPointer, firstLevel);
+					notePointerBlockVisited();
 					int firstLevelModified = 0;
 
-					for (int k = 0; k < POINTERSPBLOCK; k++)
+					PointerBlockClass firstClass;
+					classifyPointerBlock(firstLevel, &firstClass);
+					for (uint32_t w = 0; w < POINTERCLASSWORDS; w++)
 					{
-						if (firstLevel[k] != 0)
+						uint64_t present = ~firstClass.zero[w];
+						while (present)
 						{
-							if (firstLevel[k] < FIRSTDATABLOCKNUM || firstLevel[k] > LASTDATABLOCKNUM)
+							uint32_t k = (w * 64) + __builtin_ctzll(present);
+							present &= present - 1;
+							if ((firstClass.bad[w] >> (k % 64)) & 1)
 							{
 								printf("Error: Inode %u has bad triple-indirect first-level pointer %u (block %u). Fixing by nulling pointer.\n",
 									   currentInodeNum, k, firstLevel[k]);
@@ -801,67 +2033,60 @@ int validateAndFixBlockPointers(char *image)
 								firstLevelModified = 1;
 								error++;
 								fixed++;
+								continue;
 							}
-							else
-							{
-								// ? Check third level pointers
-								uint32_t secondLevel[POINTERSPBLOCK];
-								readBlock(fd, firstLevel[k], (unsigned char *)secondLevel);
-								int secondLevelModified = 0;
 
-								for (int l = 0; l < POINTERSPBLOCK; l++)
+							// ? Check third level pointers
+							uint32_t *secondLevel = (uint32_t *)walkerScratchBlock(2);
+							readWordBlock(fd, firstLevel[k], secondLevel);
+							notePointerBlockVisited();
+							int secondLevelModified = 0;
+
+							PointerBlockClass secondClass;
+							classifyPointerBlock(secondLevel, &secondClass);
+							for (uint32_t v = 0; v < POINTERCLASSWORDS; v++)
+							{
+								uint64_t secondPresent = ~secondClass.zero[v];
+								while (secondPresent)
 								{
-									if (secondLevel[l] != 0)
+									uint32_t l = (v * 64) + __builtin_ctzll(secondPresent);
+									secondPresent &= secondPresent - 1;
+									if ((secondClass.bad[v] >> (l % 64)) & 1)
+									{
+										printf("Error: Inode %u has bad triple-indirect second-level pointer %u (block %u). Fixing by nulling pointer.\n",
+											   currentInodeNum, l, secondLevel[l]);
+										secondLevel[l] = 0;
+										secondLevelModified = 1;
+										error++;
+										fixed++;
+										continue;
+									}
+
+									// ? Check fourth level pointers
+									uint32_t *thirdLevel = (uint32_t *)walkerScratchBlock(1);
+									readWordBlock(fd, secondLevel[l], thirdLevel);
+									notePointerBlockVisited();
+
+									int nulled = nullBadPointers(thirdLevel, currentInodeNum, "triple-indirect third-level");
+									if (nulled > 0)
 									{
-										if (secondLevel[l] < FIRSTDATABLOCKNUM || secondLevel[l] > LASTDATABLOCKNUM)
-										{
-											printf("Error: Inode %u has bad triple-indirect second-level pointer %u (block %u). Fixing by nulling pointer.\n",
-												   currentInodeNum, l, secondLevel[l]);
-											secondLevel[l] = 0;
-											secondLevelModified = 1;
-											error++;
-											fixed++;
-										}
-										else
-										{
-											// ? Check fourth level pointers
-											uint32_t thirdLevel[POINTERSPBLOCK];
-											readBlock(fd, secondLevel[l], (unsigned char *)thirdLevel);
-											int thirdLevelModified = 0;
-
-											for (int m = 0; m < POINTERSPBLOCK; m++)
-											{
-												if (thirdLevel[m] != 0 &&
-													(thirdLevel[m] < FIRSTDATABLOCKNUM || thirdLevel[m] > LASTDATABLOCKNUM))
-												{
-													printf("Error: Inode %u has bad triple-indirect third-level pointer %u (block %u). Fixing by nulling pointer.\n",
-														   currentInodeNum, m, thirdLevel[m]);
-													thirdLevel[m] = 0;
-													thirdLevelModified = 1;
-													error++;
-													fixed++;
-												}
-											}
-
-											if (thirdLevelModified)
-											{
-												writeBlock(fd, secondLevel[l], (unsigned char *)thirdLevel);
-											}
-										}
+										error += nulled;
+										fixed += nulled;
+										writeWordBlock(fd, secondLevel[l], thirdLevel);
 									}
 								}
+							}
 
-								if (secondLevelModified)
-								{
-									writeBlock(fd, firstLevel[k], (unsigned char *)secondLevel);
-								}
+							if (secondLevelModified)
+							{
+								writeWordBlock(fd, firstLevel[k], secondLevel);
 							}
 						}
 					}
 
 					if (firstLevelModified)
 					{
-						writeBlock(fd, currentInodePTR->tripleIndirectPointer, (unsigned char *)firstLevel);
+						writeWordBlock(fd, currentInodePTR->tripleIndirectPointer, firstLevel);
 					}
 				}
 			}
@@ -869,15 +2094,15 @@ int validateAndFixBlockPointers(char *image)
 			if (inodeModified)
 			{
 				// ? Write back the modified inode
-				writeBlock(fd, currentInodeTableBlockNum, blockBuffer);
+				writeInodeBlock(fd, currentInodeTableBlockNum, blockBuffer);
 			}
 		}
 	}
 
 	printf("Found %d bad block pointers, fixed %d\n", error, fixed);
 	printf("---------------------------------\n");
-	free(sbPTR);
-	close(fd);
+	arenaRelease(&runArena, mark);
+	closeImage(fd);
 	return error;
 }
 
@@ -888,20 +2113,61 @@ int validateAndFixBlockPointers(char *image)
 typedef struct
 {
 	uint32_t inode_num;
-	int pointer_type;  // 0-11: direct, 12: single, 13: double, 14: triple
-	int pointer_index; // index in pointer array
+	int pointer_type;	   // 0-11: direct, 12: single, 13: double, 14: triple
+	int pointer_index;	   // index in pointer array, -1 when the pointer lives in the inode
 	uint32_t block_num;
+	uint32_t parent_block; // pointer block holding the reference, 0 when it lives in the inode
 } BlockReference;
 
-// Helper to process indirect references recursively for duplicate detection
-static void processIndirectRefsForDup(int fd, uint32_t inodeNum, uint32_t indirectBlock,
-									  int ptrType, int ptrIndex, BlockReference *blockRefs, int *refCount)
+typedef struct
 {
-	if (indirectBlock == 0 || indirectBlock >= TOTALBLOCKS)
-		return;
+	BlockReference *refs;
+	uint32_t count;
+	uint32_t capacity;
+} BlockReferenceList;
+
+// Helper to append a reference, growing the list inside the run arena
+static void appendBlockReference(BlockReferenceList *list, BlockReference ref)
+{
+	if (list->count == list->capacity)
+	{
+		uint32_t newCapacity = list->capacity ? list->capacity * 2 : 256;
+		BlockReference *grown = arenaAlloc(&runArena, newCapacity * sizeof(BlockReference), sizeof(uint64_t));
+		if (list->count > 0)
+		{
+			memcpy(grown, list->refs, list->count * sizeof(BlockReference));
+		}
+		list->refs = grown;
+		list->capacity = newCapacity;
+	}
+	list->refs[list->count++] = ref;
+}
+
+// Helper to record one reference. A block already referenced by a valid inode is a duplicate.
+// Returns 1 the first time a block is seen so pointer blocks are only descended into once.
+static int recordBlockReference(BlockReferenceList *list, BlockReference ref)
+{
+	if (ref.block_num < FIRSTDATABLOCKNUM || ref.block_num > LASTDATABLOCKNUM)
+		return 0;
+
+	appendBlockReference(list, ref);
+	if (testBlockState(PLANEREFVALID, ref.block_num))
+	{
+		setBlockState(PLANEDUPLICATED, ref.block_num);
+		return 0;
+	}
+	setBlockState(PLANEREFVALID, ref.block_num);
+	return 1;
+}
 
-	uint32_t pointers[POINTERSPBLOCK];
-	readBlock(fd, indirectBlock, (unsigned char *)pointers);
+// Helper to process indirect references recursively for duplicate detection.
+// level is the depth of indirectBlock in its tree: 1 holds data pointers, 3 is a triple indirect block.
+static void processIndirectRefsForDup(int fd, uint32_t inodeNum, uint32_t indirectBlock,
+									  int ptrType, int level, BlockReferenceList *list)
+{
+	uint32_t *pointers = (uint32_t *)walkerScratchBlock(level);
+	readWordBlock(fd, indirectBlock, pointers);
+	notePointerBlockVisited();
 
 	for (int i = 0; i < POINTERSPBLOCK; i++)
 	{
@@ -909,22 +2175,10 @@ static void processIndirectRefsForDup(int fd, uint32_t inodeNum, uint32_t indire
 		if (blockNum == 0)
 			continue;
 
-		if (ptrType == 12 || ptrType == 13 || ptrType == 14)
+		int firstSeen = recordBlockReference(list, (BlockReference){inodeNum, ptrType, i, blockNum, indirectBlock});
+		if (firstSeen && level > 1)
 		{
-			// Record the reference
-			blockRefs[blockNum * POINTERSPBLOCK + refCount[blockNum]] = (BlockReference){
-				inodeNum, ptrType, i, blockNum};
-			refCount[blockNum]++;
-
-			// Recurse if needed
-			if (ptrType == 13)
-			{
-				processIndirectRefsForDup(fd, inodeNum, blockNum, ptrType, i, blockRefs, refCount);
-			}
-			else if (ptrType == 14)
-			{
-				processIndirectRefsForDup(fd, inodeNum, blockNum, 13, i, blockRefs, refCount);
-			}
+			processIndirectRefsForDup(fd, inodeNum, blockNum, ptrType, level - 1, list);
 		}
 	}
 }
@@ -945,53 +2199,50 @@ static uint32_t findFreeBlock(int fd, unsigned char *dataBitmap)
 	return 0;
 }
 
-// Helper to update a specific block reference
-static void updateBlockReference(int fd, uint32_t inodeNum, int ptrType, int ptrIndex,
-								 uint32_t oldBlock, uint32_t newBlock)
+// Helper to update a specific block reference, either in its pointer block or in the inode
+static void updateBlockReference(int fd, const BlockReference *ref, uint32_t newBlock)
 {
+	if (ref->parent_block != 0)
+	{
+		uint32_t *pointers = (uint32_t *)walkerScratchBlock(0);
+		readWordBlock(fd, ref->parent_block, pointers);
+		pointers[ref->pointer_index] = newBlock;
+		writeWordBlock(fd, ref->parent_block, pointers);
+		return;
+	}
+
 	unsigned char blockBuffer[BLOCKSIZE];
-	uint32_t inodeBlock = INODETABSBLOCKNUM + (inodeNum / (BLOCKSIZE / INODESIZE));
-	uint32_t inodeOffset = (inodeNum % (BLOCKSIZE / INODESIZE)) * INODESIZE;
+	uint32_t inodeBlock = INODETABSBLOCKNUM + (ref->inode_num / (BLOCKSIZE / INODESIZE));
+	uint32_t inodeOffset = (ref->inode_num % (BLOCKSIZE / INODESIZE)) * INODESIZE;
 
-	readBlock(fd, inodeBlock, blockBuffer);
+	readInodeBlock(fd, inodeBlock, blockBuffer);
 	Inode *inode = (Inode *)(blockBuffer + inodeOffset);
 
-	if (ptrType >= 0 && ptrType < 12)
+	switch (ref->pointer_type)
 	{
-		// Direct pointer
-		inode->directPointer[ptrType] = newBlock;
-	}
-	else
-	{
-		// Indirect pointer
-		uint32_t indirectBlock = 0;
-		switch (ptrType)
-		{
-		case 12:
-			indirectBlock = inode->singleIndirectPointer;
-			break;
-		case 13:
-			indirectBlock = inode->doubleIndirectPointer;
-			break;
-		case 14:
-			indirectBlock = inode->tripleIndirectPointer;
-			break;
-		}
-
-		uint32_t pointers[POINTERSPBLOCK];
-		readBlock(fd, indirectBlock, (unsigned char *)pointers);
-		pointers[ptrIndex] = newBlock;
-		writeBlock(fd, indirectBlock, (unsigned char *)pointers);
+	case 12:
+		inode->singleIndirectPointer = newBlock;
+		break;
+	case 13:
+		inode->doubleIndirectPointer = newBlock;
+		break;
+	case 14:
+		inode->tripleIndirectPointer = newBlock;
+		break;
+	default:
+		inode->directPointer[ref->pointer_type] = newBlock;
+		break;
 	}
 
-	writeBlock(fd, inodeBlock, blockBuffer);
+	writeInodeBlock(fd, inodeBlock, blockBuffer);
 }
 
 int detectAndFixDuplicateBlocks(char *image)
 {
-	int fd = open(image, O_RDWR);
-	Superblock *sbPTR = (Superblock *)malloc(sizeof(Superblock));
-	readBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+	int fd = openImage(image, O_RDWR);
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
 
 	printf("Checking and fixing duplicate blocks\n");
 	printf("---------------------------------\n");
@@ -1002,65 +2253,92 @@ int detectAndFixDuplicateBlocks(char *image)
 	Inode *currentInodePTR;
 	uint32_t inodesPerBlock = sbPTR->blockSize / sbPTR->inodeSize;
 
-	// Create tracking structures
-	BlockReference *blockRefs = calloc(TOTALBLOCKS * POINTERSPBLOCK, sizeof(BlockReference));
-	int *refCount = calloc(TOTALBLOCKS, sizeof(int));
-	uint32_t *originalBlocks = calloc(TOTALBLOCKS, sizeof(uint32_t));
+	// Create tracking structures. Valid references are recounted from scratch in the state table
+	BlockReferenceList list = {NULL, 0, 0};
+	clearBlockPlane(PLANEREFVALID);
+	clearBlockPlane(PLANEDUPLICATED);
 
 	// First pass: Collect all block references
 	for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
 	{
-		uint32_t currentInodeTableBlockNum = sbPTR->itabStartBlock + i;
-		readBlock(fd, currentInodeTableBlockNum, blockBuffer);
-
-		for (uint32_t j = 0; j < inodesPerBlock; j++)
+		if (pollCheckStatus())
 		{
+			break;
+		}
+		uint32_t currentInodeTableBlockNum = sbPTR->itabStartBlock + i;
+		readInodeBlock(fd, currentInodeTableBlockNum, blockBuffer);
+		noteInodesScanned(inodesPerBlock);
+
+		// Only valid inodes take part in duplicate detection
+		InodeBlockMasks masks;
+		classifyInodeBlock(blockBuffer, inodesPerBlock, sbPTR->inodeSize, &masks);
+		uint64_t pending = masks.valid;
+		while (pending)
+		{
+			uint32_t j = __builtin_ctzll(pending);
+			pending &= pending - 1;
 			uint32_t currentInodeNum = (i * inodesPerBlock) + j;
 			currentInodePTR = (Inode *)((blockBuffer + (j * sbPTR->inodeSize)));
 
-			// Skip invalid inodes
-			if (currentInodePTR->numHardLinks == 0 || currentInodePTR->deletionTime != 0)
-			{
-				continue;
-			}
-
 			// Process direct pointers
 			for (int k = 0; k < 12; k++)
 			{
 				uint32_t blockNum = currentInodePTR->directPointer[k];
-				if (blockNum != 0 && blockNum < TOTALBLOCKS)
+				if (blockNum != 0)
 				{
-					blockRefs[blockNum * POINTERSPBLOCK + refCount[blockNum]] = (BlockReference){
-						currentInodeNum, k, -1, blockNum};
-					refCount[blockNum]++;
+					recordBlockReference(&list, (BlockReference){currentInodeNum, k, -1, blockNum, 0});
 				}
 			}
 
-			// Process indirect pointers
-			processIndirectRefsForDup(fd, currentInodeNum, currentInodePTR->singleIndirectPointer,
-									  12, -1, blockRefs, refCount);
-			processIndirectRefsForDup(fd, currentInodeNum, currentInodePTR->doubleIndirectPointer,
-									  13, -1, blockRefs, refCount);
-			processIndirectRefsForDup(fd, currentInodeNum, currentInodePTR->tripleIndirectPointer,
-									  14, -1, blockRefs, refCount);
+			// Process indirect pointers, the indirect blocks themselves count as references too
+			uint32_t roots[3] = {currentInodePTR->singleIndirectPointer,
+								 currentInodePTR->doubleIndirectPointer,
+								 currentInodePTR->tripleIndirectPointer};
+			for (int level = 1; level <= 3; level++)
+			{
+				uint32_t root = roots[level - 1];
+				if (root != 0 && recordBlockReference(&list, (BlockReference){currentInodeNum, 11 + level, -1, root, 0}))
+				{
+					processIndirectRefsForDup(fd, currentInodeNum, root, 11 + level, level, &list);
+				}
+			}
 		}
 	}
 
-	// Second pass: Find and fix duplicates
+	// Second pass: Find and fix duplicates. Nothing has been written yet, so a cancel still leaves the image untouched
+	if (isCheckCancelled())
+	{
+		arenaRelease(&runArena, mark);
+		closeImage(fd);
+		return error;
+	}
+
 	unsigned char dataBitmap[BLOCKSIZE];
 	readBlock(fd, DATABIMBLOCKNUM, dataBitmap);
 
-	for (uint32_t blockNum = FIRSTDATABLOCKNUM; blockNum <= LASTDATABLOCKNUM; blockNum++)
+	for (uint32_t w = 0; w < BLOCKSTATEWORDS; w++)
 	{
-		if (refCount[blockNum] > 1)
+		uint64_t duplicated = blockState[PLANEDUPLICATED][w];
+		while (duplicated)
 		{
-			printf("Duplicate: Block %u referenced %d times\n", blockNum, refCount[blockNum]);
+			uint32_t blockNum = (w * 64) + __builtin_ctzll(duplicated);
+			duplicated &= duplicated - 1;
+
+			int refCount = 0;
+			for (uint32_t r = 0; r < list.count; r++)
+			{
+				refCount += list.refs[r].block_num == blockNum;
+			}
+			printf("Duplicate: Block %u referenced %d times\n", blockNum, refCount);
 			error++;
 
 			// Keep first reference, fix others
-			for (int dup = 1; dup < refCount[blockNum]; dup++)
+			int seen = 0;
+			for (uint32_t r = 0; r < list.count; r++)
 			{
-				BlockReference ref = blockRefs[blockNum * POINTERSPBLOCK + dup];
+				if (list.refs[r].block_num != blockNum || seen++ == 0)
+					continue;
+				BlockReference ref = list.refs[r];
 
 				// Allocate new block
 				uint32_t newBlock = findFreeBlock(fd, dataBitmap);
@@ -1076,8 +2354,7 @@ int detectAndFixDuplicateBlocks(char *image)
 				writeBlock(fd, newBlock, data);
 
 				// Update reference to point to new block
-				updateBlockReference(fd, ref.inode_num, ref.pointer_type,
-									 ref.pointer_index, blockNum, newBlock);
+				updateBlockReference(fd, &ref, newBlock);
 
 				printf("Fixed: Replaced reference (inode %u) with new block %u\n",
 					   ref.inode_num, newBlock);
@@ -1090,10 +2367,3411 @@ int detectAndFixDuplicateBlocks(char *image)
 	printf("Found %d duplicate blocks, fixed %d references\n", error, fixed);
 	printf("---------------------------------\n");
 
-	free(blockRefs);
-	free(refCount);
-	free(originalBlocks);
-	free(sbPTR);
-	close(fd);
+	arenaRelease(&runArena, mark);
+	closeImage(fd);
 	return error;
+}
+
+// ! ############################## Progress Reporting and Cancellation ##############################
+
+// ? ############################## SIGNAL HANDLERS ##############################
+
+static void onStatusTimer(int signalNum)
+{
+	(void)signalNum;
+	statusLineDue = 1;
+}
+
+static void onStatusDump(int signalNum)
+{
+	(void)signalNum;
+	statusDumpRequested = 1;
+}
+
+static void onCancel(int signalNum)
+{
+	(void)signalNum;
+	cancelRequested = 1;
+}
+
+// ? ############################## INSTALL PROGRESS HANDLERS ##############################
+
+// SIGUSR1 dumps the counters once, SIGINT/SIGTERM request a cancel at the next safe point and a
+// non-zero interval additionally prints a status line that often. Handlers only raise flags, all
+// printing happens from pollCheckStatus on the checker's own thread.
+void installProgressHandlers(int statusIntervalSeconds)
+{
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+
+	action.sa_handler = onStatusDump;
+	sigaction(SIGUSR1, &action, NULL);
+	action.sa_handler = onCancel;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	if (statusIntervalSeconds > 0)
+	{
+		action.sa_handler = onStatusTimer;
+		sigaction(SIGALRM, &action, NULL);
+
+		struct itimerval interval;
+		memset(&interval, 0, sizeof(interval));
+		interval.it_interval.tv_sec = statusIntervalSeconds;
+		interval.it_value.tv_sec = statusIntervalSeconds;
+		setitimer(ITIMER_REAL, &interval, NULL);
+	}
+}
+
+// ? ############################## PROGRESS API ##############################
+
+void setCheckPhase(const char *phase)
+{
+	atomic_store_explicit(&currentPhaseName, phase, memory_order_relaxed);
+	pollCheckStatus();
+}
+
+void noteInodesScanned(uint32_t count)
+{
+	atomic_fetch_add_explicit(&inodesScannedCounter, count, memory_order_relaxed);
+}
+
+void notePointerBlockVisited(void)
+{
+	atomic_fetch_add_explicit(&pointerBlocksVisitedCounter, 1, memory_order_relaxed);
+}
+
+void getCheckProgress(CheckProgress *progress)
+{
+	progress->inodesScanned = atomic_load_explicit(&inodesScannedCounter, memory_order_relaxed);
+	progress->pointerBlocksVisited = atomic_load_explicit(&pointerBlocksVisitedCounter, memory_order_relaxed);
+	progress->repairsQueued = atomic_load_explicit(&repairsQueuedCounter, memory_order_relaxed);
+	progress->phase = atomic_load_explicit(&currentPhaseName, memory_order_relaxed);
+	progress->cancelled = cancelRequested;
+}
+
+void requestCheckCancel(void)
+{
+	cancelRequested = 1;
+}
+
+int isCheckCancelled(void)
+{
+	return cancelRequested;
+}
+
+// ? ############################## POLL CHECK STATUS ##############################
+
+// Called at safe points in the scan loops. Prints any pending status line and returns non-zero
+// once a cancel was requested. The common case is three flag loads and no branch taken.
+int pollCheckStatus(void)
+{
+	if (!(statusLineDue | statusDumpRequested | cancelRequested))
+	{
+		return 0;
+	}
+
+	if (statusLineDue || statusDumpRequested)
+	{
+		CheckProgress progress;
+		getCheckProgress(&progress);
+		fprintf(stderr, "[%s] phase: %s | inodes scanned: %llu | pointer blocks visited: %llu | repairs queued: %llu\n",
+				statusDumpRequested ? "status" : "progress", progress.phase,
+				(unsigned long long)progress.inodesScanned,
+				(unsigned long long)progress.pointerBlocksVisited,
+				(unsigned long long)progress.repairsQueued);
+		statusLineDue = 0;
+		statusDumpRequested = 0;
+	}
+	return cancelRequested;
+}
+
+int reportCheckCancelled(void)
+{
+	pollCheckStatus();
+	// Repairs still in the overlay were never written, the image is left as the last commit left it
+	endRepairOverlay();
+	closeUndoLog();
+	arenaFree(&runArena);
+	printf("Check cancelled by user request. Repairs not yet written to the image were discarded.\n");
+	return EXITCANCELLED;
+}
+
+// ! ############################## On-Disk Encoding ##############################
+
+// Every integer of a VSFS image is stored little-endian. The superblock holds the 16-bit magic at
+// offset 0 and 32-bit fields from offset 4; the first 44 bytes of its reserved area are the clean
+// state marker and the group layout. An inode record is 25 32-bit fields followed by 156 reserved
+// bytes. Pointer blocks and the group descriptor table are arrays of 32-bit words. The structs
+// mirror these layouts byte for byte, so decoding swaps the words in place, and a little-endian
+// host does nothing at all. Bitmaps, data blocks and the repair overlay stay raw bytes, and the undo
+// log keeps raw blocks behind little-endian record headers.
+_Static_assert(offsetof(Superblock, blockSize) == 4 && offsetof(Superblock, reserved) == 36 &&
+				   sizeof(Superblock) == BLOCKSIZE,
+			   "Superblock must match the on-disk layout");
+_Static_assert(offsetof(Inode, directPointer) == 40 && offsetof(Inode, singleIndirectPointer) == 88 &&
+				   offsetof(Inode, reserved) == 100 && sizeof(Inode) == INODESIZE,
+			   "Inode must match the on-disk layout");
+_Static_assert(sizeof(GroupDescriptor) == 8 * sizeof(uint32_t), "GroupDescriptor must match the on-disk layout");
+
+#define SUPERBLOCKFIELDWORDS ((offsetof(Superblock, reserved) - offsetof(Superblock, blockSize)) / sizeof(uint32_t))
+#define SUPERBLOCKRESERVEDWORDS ((sizeof(CleanStateMarker) + sizeof(GroupLayout)) / sizeof(uint32_t))
+#define INODEFIELDWORDS (offsetof(Inode, reserved) / sizeof(uint32_t))
+
+// ? ############################## SWAP LE32 WORDS ##############################
+
+// Converts count 32-bit words between little-endian and host order in place; the conversion is its
+// own inverse. A straight loop over a whole block, which the compiler turns into vector byte shuffles.
+void swapLE32Words(uint32_t *words, size_t count)
+{
+#if HOSTISBIGENDIAN
+	for (size_t k = 0; k < count; k++)
+	{
+		words[k] = __builtin_bswap32(words[k]);
+	}
+#else
+	(void)words;
+	(void)count;
+#endif
+}
+
+// ? ############################## SWAP SUPERBLOCK ##############################
+
+void swapSuperblock(Superblock *sbPTR)
+{
+#if HOSTISBIGENDIAN
+	sbPTR->magicByte = __builtin_bswap16(sbPTR->magicByte);
+	swapLE32Words(&sbPTR->blockSize, SUPERBLOCKFIELDWORDS);
+	swapLE32Words((uint32_t *)sbPTR->reserved, SUPERBLOCKRESERVEDWORDS);
+#else
+	(void)sbPTR;
+#endif
+}
+
+// ? ############################## SWAP INODE RECORDS ##############################
+
+// Swaps the fields of count consecutive inode records, leaving their reserved bytes alone
+void swapInodeRecords(unsigned char *buffer, uint32_t count)
+{
+#if HOSTISBIGENDIAN
+	for (uint32_t j = 0; j < count; j++)
+	{
+		swapLE32Words((uint32_t *)(buffer + (j * INODESIZE)), INODEFIELDWORDS);
+	}
+#else
+	(void)buffer;
+	(void)count;
+#endif
+}
+
+// ? ############################## TYPED BLOCK I/O ##############################
+
+// readBlock/writeBlock move raw image bytes. These wrappers decode a block after reading it and
+// write an encoded copy, so callers only ever see host-order structs.
+void readSuperblock(int fd, Superblock *sbPTR)
+{
+	readBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+	swapSuperblock(sbPTR);
+}
+
+void writeSuperblock(int fd, const Superblock *sbPTR)
+{
+#if HOSTISBIGENDIAN
+	Superblock encoded = *sbPTR;
+	swapSuperblock(&encoded);
+	writeBlock(fd, SUPERBLOCKNUM, (unsigned char *)&encoded);
+#else
+	writeBlock(fd, SUPERBLOCKNUM, (unsigned char *)sbPTR);
+#endif
+}
+
+// An inode-table block, decoded as BLOCKSIZE / INODESIZE records
+void readInodeBlock(int fd, uint32_t blockNum, unsigned char *buffer)
+{
+	readBlock(fd, blockNum, buffer);
+	swapInodeRecords(buffer, BLOCKSIZE / INODESIZE);
+}
+
+void writeInodeBlock(int fd, uint32_t blockNum, const unsigned char *buffer)
+{
+#if HOSTISBIGENDIAN
+	uint32_t encoded[POINTERSPBLOCK];
+	memcpy(encoded, buffer, BLOCKSIZE);
+	swapInodeRecords((unsigned char *)encoded, BLOCKSIZE / INODESIZE);
+	writeBlock(fd, blockNum, (unsigned char *)encoded);
+#else
+	writeBlock(fd, blockNum, (unsigned char *)buffer);
+#endif
+}
+
+// A block of 32-bit words: a pointer block or the group descriptor table
+void readWordBlock(int fd, uint32_t blockNum, uint32_t *words)
+{
+	readBlock(fd, blockNum, (unsigned char *)words);
+	swapLE32Words(words, POINTERSPBLOCK);
+}
+
+void writeWordBlock(int fd, uint32_t blockNum, const uint32_t *words)
+{
+#if HOSTISBIGENDIAN
+	uint32_t encoded[POINTERSPBLOCK];
+	memcpy(encoded, words, BLOCKSIZE);
+	swapLE32Words(encoded, POINTERSPBLOCK);
+	writeBlock(fd, blockNum, (unsigned char *)encoded);
+#else
+	writeBlock(fd, blockNum, (unsigned char *)words);
+#endif
+}
+
+// ? ############################## SWAP UNDO LOG HEADERS ##############################
+
+// The undo log is little-endian like the image, so a log outlives a move to another host
+void swapUndoLogHeader(UndoLogHeader *header)
+{
+	swapLE32Words(&header->version, 2);
+}
+
+void swapUndoRecordHeader(UndoRecordHeader *record)
+{
+	swapLE32Words(&record->recordMagic, 2);
+#if HOSTISBIGENDIAN
+	record->checksum = __builtin_bswap64(record->checksum);
+#endif
+}
+
+// ! ############################## Inode Prefilter ##############################
+
+// ? ############################## ZERO RECORD TEST ##############################
+
+// Most inode slots in a real image were never used and are entirely zero, so the scan loops ask
+// the prefilter which slots deserve a field-by-field look instead of casting every record.
+int isZeroRecord(const unsigned char *record, uint32_t size)
+{
+	uint32_t k = 0;
+#if defined(__SSE2__)
+	__m128i acc = _mm_setzero_si128();
+	for (; k + 64 <= size; k += 64)
+	{
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(record + k)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(record + k + 16)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(record + k + 32)));
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(record + k + 48)));
+	}
+	for (; k + 16 <= size; k += 16)
+	{
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i *)(record + k)));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+	{
+		return 0;
+	}
+#else
+	uint64_t acc = 0;
+	for (; k + sizeof(uint64_t) <= size; k += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, record + k, sizeof(word));
+		acc |= word;
+	}
+	if (acc != 0)
+	{
+		return 0;
+	}
+#endif
+	for (; k < size; k++)
+	{
+		if (record[k] != 0)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// ? ############################## CLASSIFY INODE BLOCK ##############################
+
+// Builds the free/valid/deleted-but-allocated masks of one decoded inode-table block. A first
+// sweep gathers the tested fields of the non-empty slots into InodeHotFields, a second one builds
+// the masks from those arrays without branching. Slots past MAXINODESPERBLOCK are not described.
+void classifyInodeBlock(const unsigned char *blockBuffer, uint32_t inodesPerBlock, uint32_t inodeSize, InodeBlockMasks *masks)
+{
+	if (inodesPerBlock > MAXINODESPERBLOCK)
+	{
+		inodesPerBlock = MAXINODESPERBLOCK;
+	}
+
+	// An all-zero slot reads as zero in every field, which makes it neither valid nor allocated
+	InodeHotFields hot;
+	uint64_t nonEmpty = 0;
+	for (uint32_t j = 0; j < inodesPerBlock; j++)
+	{
+		const unsigned char *record = blockBuffer + (j * inodeSize);
+		if (isZeroRecord(record, inodeSize))
+		{
+			hot.numHardLinks[j] = 0;
+			hot.deletionTime[j] = 0;
+			hot.numDataBlocksAllocated[j] = 0;
+			continue;
+		}
+		nonEmpty |= (uint64_t)1 << j;
+
+		const Inode *inode = (const Inode *)record;
+		hot.numHardLinks[j] = inode->numHardLinks;
+		hot.deletionTime[j] = inode->deletionTime;
+		hot.numDataBlocksAllocated[j] = inode->numDataBlocksAllocated;
+	}
+
+	uint64_t valid = 0;
+	uint64_t deletedAllocated = 0;
+	for (uint32_t j = 0; j < inodesPerBlock; j++)
+	{
+		uint64_t isValid = (hot.numHardLinks[j] != 0) & (hot.deletionTime[j] == 0);
+		valid |= isValid << j;
+		deletedAllocated |= ((isValid ^ 1) & (hot.numDataBlocksAllocated[j] != 0)) << j;
+	}
+	masks->nonEmpty = nonEmpty;
+	masks->valid = valid;
+	masks->deletedAllocated = deletedAllocated;
+}
+
+// ? ############################## EXTRACT BITMAP BITS ##############################
+
+// Returns count (at most 64) consecutive bitmap bits starting at firstBit, bit 0 of the result being firstBit
+uint64_t extractBitmapBits(const unsigned char *bitMap, uint32_t firstBit, uint32_t count)
+{
+	uint64_t bits = 0;
+	for (uint32_t k = 0; k < count && k < 64; k++)
+	{
+		bits |= (uint64_t)bitCheck(bitMap, firstBit + k) << k;
+	}
+	return bits;
+}
+
+// ? ############################## CLASSIFY POINTER BLOCK ##############################
+
+// Range-checks all entries of a pointer block at once, returning the number of bad entries. The
+// checkers then only visit non-zero entries and only branch on the rare bad one.
+uint32_t classifyPointerBlock(const uint32_t *pointers, PointerBlockClass *cls)
+{
+	uint32_t badCount = 0;
+	for (uint32_t w = 0; w < POINTERCLASSWORDS; w++)
+	{
+		const uint32_t *group = pointers + (w * 64);
+		uint64_t zero = 0;
+		uint64_t bad = 0;
+#if defined(__SSE2__)
+		// SSE2 only compares signed lanes: flipping the sign bit of both sides turns the unsigned
+		// range test into a signed one
+		const __m128i bias = _mm_set1_epi32((int)0x80000000u);
+		const __m128i first = _mm_set1_epi32((int)(FIRSTDATABLOCKNUM ^ 0x80000000u));
+		const __m128i last = _mm_set1_epi32((int)(LASTDATABLOCKNUM ^ 0x80000000u));
+		for (uint32_t k = 0; k < 64; k += 4)
+		{
+			__m128i value = _mm_loadu_si128((const __m128i *)(group + k));
+			__m128i biased = _mm_xor_si128(value, bias);
+			__m128i isZero = _mm_cmpeq_epi32(value, _mm_setzero_si128());
+			__m128i outside = _mm_or_si128(_mm_cmplt_epi32(biased, first), _mm_cmpgt_epi32(biased, last));
+			zero |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(isZero)) << k;
+			bad |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(isZero, outside))) << k;
+		}
+#else
+		for (uint32_t k = 0; k < 64; k++)
+		{
+			uint32_t value = group[k];
+			zero |= (uint64_t)(value == 0) << k;
+			bad |= (uint64_t)(value != 0 && (value < FIRSTDATABLOCKNUM || value > LASTDATABLOCKNUM)) << k;
+		}
+#endif
+		cls->zero[w] = zero;
+		cls->bad[w] = bad;
+		badCount += __builtin_popcountll(bad);
+	}
+	return badCount;
+}
+
+// ! ############################## Reference Image Restore ##############################
+
+// ? ############################## HASH BLOCK ##############################
+
+// 64-bit FNV-1a over one block, the checksum of an undo record
+uint64_t hashBlock(const unsigned char *buffer)
+{
+	uint64_t hash = 0xCBF29CE484222325ULL;
+	for (int i = 0; i < BLOCKSIZE; i++)
+	{
+		hash ^= buffer[i];
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+// ? ############################## SUPERBLOCK CONSISTENCY ##############################
+
+// Quiet version of validateSuperblock for images we only read from
+int isSuperblockConsistent(const Superblock *sbPTR)
+{
+	return sbPTR->magicByte == MAGICNUM &&
+		   sbPTR->blockSize == BLOCKSIZE &&
+		   sbPTR->totalBlocks == TOTALBLOCKS &&
+		   sbPTR->ibimBlock == INODEBIMBLOCKNUM &&
+		   sbPTR->dbimBlock == DATABIMBLOCKNUM &&
+		   sbPTR->itabStartBlock == INODETABSBLOCKNUM &&
+		   sbPTR->firstDataBlock == FIRSTDATABLOCKNUM &&
+		   sbPTR->inodeSize == INODESIZE &&
+		   sbPTR->inodeCount == INODECOUNT;
+}
+
+// Newest creation/modification/deletion time of any inode in an inode-table block
+static uint32_t newestInodeTime(const unsigned char *blockBuffer)
+{
+	uint32_t newest = 0;
+	InodeBlockMasks masks;
+	classifyInodeBlock(blockBuffer, BLOCKSIZE / INODESIZE, INODESIZE, &masks);
+	uint64_t pending = masks.nonEmpty;
+	while (pending)
+	{
+		uint32_t j = __builtin_ctzll(pending);
+		pending &= pending - 1;
+		const Inode *inode = (const Inode *)(blockBuffer + (j * INODESIZE));
+		if (inode->createionTime > newest)
+			newest = inode->createionTime;
+		if (inode->lastModificationTime > newest)
+			newest = inode->lastModificationTime;
+		if (inode->deletionTime > newest)
+			newest = inode->deletionTime;
+	}
+	return newest;
+}
+
+// The reference is only trusted if its own bitmaps agree with its inode table: every valid inode
+// is marked in the inode bitmap (and nothing else is), and every block a valid inode points to
+// directly or through its top-level indirect pointers is marked in the data bitmap.
+static int isReferenceSelfConsistent(unsigned char metadata[FIRSTDATABLOCKNUM][BLOCKSIZE])
+{
+	const unsigned char *inodeBitmap = metadata[INODEBIMBLOCKNUM];
+	const unsigned char *dataBitmap = metadata[DATABIMBLOCKNUM];
+	uint32_t inodesPerBlock = BLOCKSIZE / INODESIZE;
+
+	for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
+	{
+		const unsigned char *blockBuffer = metadata[INODETABSBLOCKNUM + i];
+		InodeBlockMasks masks;
+		classifyInodeBlock(blockBuffer, inodesPerBlock, INODESIZE, &masks);
+		if (masks.valid != extractBitmapBits(inodeBitmap, i * inodesPerBlock, inodesPerBlock))
+		{
+			return 0;
+		}
+
+		uint64_t pending = masks.valid;
+		while (pending)
+		{
+			uint32_t j = __builtin_ctzll(pending);
+			pending &= pending - 1;
+			const Inode *inode = (const Inode *)(blockBuffer + (j * INODESIZE));
+			uint32_t pointers[15];
+			memcpy(pointers, inode->directPointer, sizeof(inode->directPointer));
+			pointers[12] = inode->singleIndirectPointer;
+			pointers[13] = inode->doubleIndirectPointer;
+			pointers[14] = inode->tripleIndirectPointer;
+			for (int k = 0; k < 15; k++)
+			{
+				if (pointers[k] == 0)
+					continue;
+				if (pointers[k] < FIRSTDATABLOCKNUM || pointers[k] > LASTDATABLOCKNUM ||
+					!bitCheck(dataBitmap, pointers[k] - FIRSTDATABLOCKNUM))
+				{
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+// A wiped block, or a superblock that no longer describes the layout, reads as newest time 0 and
+// would make any backup look newer. Such a block is restored regardless.
+static int isImageBlockDamaged(uint32_t blockNum, const unsigned char *blockBuffer)
+{
+	if (blockNum == SUPERBLOCKNUM)
+	{
+		return !isSuperblockConsistent((const Superblock *)blockBuffer);
+	}
+	return isZeroRecord(blockBuffer, BLOCKSIZE);
+}
+
+// ? ############################## RESTORE FROM REFERENCE ##############################
+
+// Compares the superblock, both bitmaps and the inode table against a known-good backup and copies
+// back only the blocks that differ. A block is restored only when the backup is self-consistent and
+// not newer than the image: inode-table blocks compare their own newest inode timestamp, the
+// superblock and bitmaps compare the newest timestamp of the whole inode table. A block the image
+// lost outright has no timestamp worth comparing and is always restored.
+// Returns the number of restored blocks, or -1 if the reference could not be used.
+int restoreFromReference(char *image, char *reference)
+{
+	printf("Restoring metadata from reference image: %s\n", reference);
+	printf("---------------------------------\n");
+
+	int fd = openImage(image, O_RDWR);
+	int refFd = openImage(reference, O_RDONLY);
+	if (fd < 0 || refFd < 0)
+	{
+		printf("Error: Could not open %s. Skipping reference restore.\n", fd < 0 ? image : reference);
+		if (fd >= 0)
+			closeImage(fd);
+		if (refFd >= 0)
+			closeImage(refFd);
+		return -1;
+	}
+
+	ArenaMark mark = arenaMark(&runArena);
+	unsigned char (*imageMeta)[BLOCKSIZE] = arenaAlloc(&runArena, FIRSTDATABLOCKNUM * BLOCKSIZE, BLOCKSIZE);
+	unsigned char (*refMeta)[BLOCKSIZE] = arenaAlloc(&runArena, FIRSTDATABLOCKNUM * BLOCKSIZE, BLOCKSIZE);
+	// Both images are read side by side, block for block
+	for (uint32_t b = 0; b < FIRSTDATABLOCKNUM; b++)
+	{
+		readBlock(fd, b, imageMeta[b]);
+		readBlock(refFd, b, refMeta[b]);
+		if (b == SUPERBLOCKNUM)
+		{
+			// The clean state marker belongs to the image, a backup's marker is neither compared nor restored
+			memcpy(((Superblock *)refMeta[b])->reserved, ((Superblock *)imageMeta[b])->reserved, sizeof(CleanStateMarker));
+		}
+	}
+
+	// Decoded for the consistency and timestamp checks, both the same way so equal blocks stay equal
+	swapSuperblock((Superblock *)imageMeta[SUPERBLOCKNUM]);
+	swapSuperblock((Superblock *)refMeta[SUPERBLOCKNUM]);
+	swapInodeRecords(imageMeta[INODETABSBLOCKNUM], INODECOUNT);
+	swapInodeRecords(refMeta[INODETABSBLOCKNUM], INODECOUNT);
+
+	int restored = 0;
+	if (!isSuperblockConsistent((const Superblock *)refMeta[SUPERBLOCKNUM]) || !isReferenceSelfConsistent(refMeta))
+	{
+		printf("Error: Reference image is not self-consistent. Skipping reference restore.\n");
+		restored = -1;
+	}
+	else
+	{
+		uint32_t imageNewest = 0;
+		uint32_t refNewest = 0;
+		for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
+		{
+			// A lost block is restored below, so the table ends up with the backup's times for it
+			uint32_t refBlockNewest = newestInodeTime(refMeta[INODETABSBLOCKNUM + i]);
+			uint32_t imageBlockNewest = isImageBlockDamaged(INODETABSBLOCKNUM + i, imageMeta[INODETABSBLOCKNUM + i])
+											? refBlockNewest
+											: newestInodeTime(imageMeta[INODETABSBLOCKNUM + i]);
+			if (imageBlockNewest > imageNewest)
+				imageNewest = imageBlockNewest;
+			if (refBlockNewest > refNewest)
+				refNewest = refBlockNewest;
+		}
+
+		for (uint32_t b = 0; b < FIRSTDATABLOCKNUM; b++)
+		{
+			if (memcmp(imageMeta[b], refMeta[b], BLOCKSIZE) == 0)
+			{
+				continue;
+			}
+
+			const char *kind = "inode table";
+			uint32_t imageTime = imageNewest;
+			uint32_t refTime = refNewest;
+			if (b == SUPERBLOCKNUM)
+				kind = "superblock";
+			else if (b == INODEBIMBLOCKNUM)
+				kind = "inode bitmap";
+			else if (b == DATABIMBLOCKNUM)
+				kind = "data bitmap";
+			else
+			{
+				imageTime = newestInodeTime(imageMeta[b]);
+				refTime = newestInodeTime(refMeta[b]);
+			}
+
+			if (refTime > imageTime && !isImageBlockDamaged(b, imageMeta[b]))
+			{
+				printf("Skipped: Block %u (%s) differs but the reference copy is newer than the image.\n", b, kind);
+				continue;
+			}
+			if (b == SUPERBLOCKNUM)
+				writeSuperblock(fd, (const Superblock *)refMeta[b]);
+			else if (b >= INODETABSBLOCKNUM)
+				writeInodeBlock(fd, b, refMeta[b]);
+			else
+				writeBlock(fd, b, refMeta[b]);
+			printf("Restored: Block %u (%s) from reference image.\n", b, kind);
+			restored++;
+		}
+		printf("Restored %d metadata blocks from reference image\n", restored);
+	}
+
+	arenaRelease(&runArena, mark);
+	closeImage(refFd);
+	closeImage(fd);
+	return restored;
+}
+
+// ! ############################## Undo Log ##############################
+
+// ? ############################## ENABLE UNDO LOG ##############################
+
+// Repairs of <image> are undoable through <image>.undo. The log is only created once something is
+// actually written, and runs append to it, so a rollback returns to the state before the first
+// logged run.
+void enableUndoLog(char *image)
+{
+	snprintf(undoLogPath, sizeof(undoLogPath), "%s.undo", image);
+	memset(undoLoggedBlocks, 0, sizeof(undoLoggedBlocks));
+	undoLogEnabled = 1;
+}
+
+// ? ############################## LOG BLOCK FOR UNDO ##############################
+
+// Appends the current contents of blockNum to the undo log and syncs the log. Each block is logged
+// once per run, which is all a rollback needs since it restores the oldest copy of every block.
+// Returns 0 once the original contents are durable, -1 if they are not and the block must not be
+// overwritten. After the first failure every call fails, so a repair stops rather than going on
+// without a way back.
+int logBlockForUndo(int fd, uint32_t blockNum)
+{
+	if (undoLogFailed)
+	{
+		return -1;
+	}
+	if (!undoLogEnabled)
+	{
+		return 0;
+	}
+	if (blockNum < TOTALBLOCKS && bitCheck(undoLoggedBlocks, blockNum))
+	{
+		return 0;
+	}
+
+	if (undoLogFd < 0)
+	{
+		undoLogFd = open(undoLogPath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (undoLogFd < 0)
+		{
+			printf("Error: Could not open undo log %s: %s. Refusing to repair without it (use --no-undo to allow that).\n",
+				   undoLogPath, strerror(errno));
+			undoLogFailed = 1;
+			return -1;
+		}
+		struct stat st;
+		if (fstat(undoLogFd, &st) == 0 && st.st_size == 0)
+		{
+			UndoLogHeader header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.magic, UNDOLOGMAGIC, sizeof(header.magic));
+			header.version = UNDOLOGVERSION;
+			header.blockSize = BLOCKSIZE;
+			swapUndoLogHeader(&header);
+			if (write(undoLogFd, &header, sizeof(header)) != sizeof(header))
+			{
+				printf("Error: Could not write undo log %s: %s. Refusing to repair without it.\n", undoLogPath, strerror(errno));
+				undoLogFailed = 1;
+				return -1;
+			}
+		}
+	}
+
+	unsigned char original[BLOCKSIZE];
+	readBlock(fd, blockNum, original);
+
+	UndoRecordHeader record;
+	record.recordMagic = UNDORECORDMAGIC;
+	record.blockNum = blockNum;
+	record.checksum = hashBlock(original);
+	swapUndoRecordHeader(&record);
+
+	// A short append leaves a torn record at the tail, which a rollback stops at
+	struct iovec parts[2];
+	parts[0].iov_base = &record;
+	parts[0].iov_len = sizeof(record);
+	parts[1].iov_base = original;
+	parts[1].iov_len = BLOCKSIZE;
+	if (writev(undoLogFd, parts, 2) != (ssize_t)(sizeof(record) + BLOCKSIZE) || fdatasync(undoLogFd) != 0)
+	{
+		printf("Error: Could not save block %u to undo log %s: %s. Stopping repairs, blocks already written can be rolled back with --undo.\n",
+			   blockNum, undoLogPath, strerror(errno));
+		undoLogFailed = 1;
+		return -1;
+	}
+
+	if (blockNum < TOTALBLOCKS)
+	{
+		setBit(undoLoggedBlocks, blockNum);
+	}
+	return 0;
+}
+
+void closeUndoLog(void)
+{
+	if (undoLogFd >= 0)
+	{
+		close(undoLogFd);
+		if (!undoLogFailed)
+		{
+			printf("Original contents of every repaired block saved to %s (roll back with --undo)\n", undoLogPath);
+		}
+	}
+	undoLogFd = -1;
+	undoLogEnabled = 0;
+}
+
+// ? ############################## ROLLBACK FROM UNDO LOG ##############################
+
+// Replays <image>.undo in one sequential pass. The first record of a block holds its oldest
+// contents, later records of the same block are skipped. A record cut short by the end of the log
+// (crash while appending) ends the replay; the write it was protecting never happened. A damaged
+// record before that, or a block that can not be written back, stops the replay too, but keeps
+// the log and returns 1: the log is only removed once every record was verified and restored.
+int rollbackFromUndoLog(char *image)
+{
+	char path[MAXPATHLEN];
+	snprintf(path, sizeof(path), "%s.undo", image);
+
+	printf("Rolling back %s from undo log %s\n", image, path);
+	printf("---------------------------------\n");
+
+	int logFd = open(path, O_RDONLY);
+	if (logFd < 0)
+	{
+		printf("No undo log found. Nothing to roll back.\n");
+		return 1;
+	}
+
+	struct stat logStat;
+	UndoLogHeader header;
+	int isHeaderRead = fstat(logFd, &logStat) == 0 && read(logFd, &header, sizeof(header)) == sizeof(header);
+	swapUndoLogHeader(&header);
+	if (!isHeaderRead || memcmp(header.magic, UNDOLOGMAGIC, sizeof(header.magic)) != 0 ||
+		header.version != UNDOLOGVERSION || header.blockSize != BLOCKSIZE)
+	{
+		printf("Error: %s is not a VSFS undo log.\n", path);
+		close(logFd);
+		return 1;
+	}
+
+	int fd = openImage(image, O_RDWR);
+	if (fd < 0)
+	{
+		printf("Error: Could not open %s.\n", image);
+		close(logFd);
+		return 1;
+	}
+
+	uint32_t restoredCapacity = TOTALBLOCKS;
+	unsigned char *restoredBlocks = calloc(restoredCapacity / 8, 1);
+	unsigned char original[BLOCKSIZE];
+	UndoRecordHeader record;
+	int restored = 0;
+	int isComplete = 1;
+	off_t offset = sizeof(header);
+
+	while (offset < logStat.st_size)
+	{
+		if (logStat.st_size - offset < (off_t)(sizeof(record) + BLOCKSIZE))
+		{
+			printf("Warning: Undo log ends with an incomplete record. Stopping there.\n");
+			break;
+		}
+		if (read(logFd, &record, sizeof(record)) != sizeof(record) || read(logFd, original, BLOCKSIZE) != BLOCKSIZE)
+		{
+			printf("Error: Could not read the undo log record at offset %lld.\n", (long long)offset);
+			isComplete = 0;
+			break;
+		}
+		swapUndoRecordHeader(&record);
+		if (record.recordMagic != UNDORECORDMAGIC || hashBlock(original) != record.checksum)
+		{
+			printf("Error: Undo log record at offset %lld is damaged. Stopping there.\n", (long long)offset);
+			isComplete = 0;
+			break;
+		}
+		offset += sizeof(record) + BLOCKSIZE;
+
+		if (record.blockNum >= restoredCapacity)
+		{
+			uint32_t newCapacity = restoredCapacity;
+			while (record.blockNum >= newCapacity)
+			{
+				newCapacity *= 2;
+			}
+			restoredBlocks = realloc(restoredBlocks, newCapacity / 8);
+			memset(restoredBlocks + restoredCapacity / 8, 0, (newCapacity - restoredCapacity) / 8);
+			restoredCapacity = newCapacity;
+		}
+		if (bitCheck(restoredBlocks, record.blockNum))
+		{
+			continue;
+		}
+
+		if (writeBlock(fd, record.blockNum, original) != 0)
+		{
+			printf("Error: Could not write block %u back to %s. Stopping there.\n", record.blockNum, image);
+			isComplete = 0;
+			break;
+		}
+		setBit(restoredBlocks, record.blockNum);
+		restored++;
+	}
+	if (fsync(fd) != 0)
+	{
+		printf("Error: Could not sync %s.\n", image);
+		isComplete = 0;
+	}
+
+	free(restoredBlocks);
+	closeImage(fd);
+	close(logFd);
+
+	if (!isComplete)
+	{
+		printf("Rolled back %d blocks, the rest could not be restored. Undo log kept.\n", restored);
+		printf("---------------------------------\n");
+		return 1;
+	}
+	unlink(path);
+	printf("Rolled back %d blocks. Undo log removed.\n", restored);
+	printf("---------------------------------\n");
+	return 0;
+}
+
+// ! ############################## Repair Overlay ##############################
+
+// Regions each phase reads, so a repair only makes the phases it can affect due again
+static const uint32_t repairPhaseRegions[NUMREPAIRPHASES] = {
+	[REPAIRPHASESUPERBLOCK] = REGIONSUPERBLOCK,
+	[REPAIRPHASEINODEBITMAP] = REGIONSUPERBLOCK | REGIONINODEBITMAP | REGIONINODETABLE,
+	[REPAIRPHASEDATABITMAP] = REGIONSUPERBLOCK | REGIONDATABITMAP | REGIONINODETABLE | REGIONDATA,
+	[REPAIRPHASEPOINTERS] = REGIONSUPERBLOCK | REGIONINODETABLE | REGIONDATA,
+	[REPAIRPHASEDUPLICATES] = REGIONSUPERBLOCK | REGIONDATABITMAP | REGIONINODETABLE | REGIONDATA,
+};
+
+static uint32_t blockRegion(uint32_t blockNum)
+{
+	if (blockNum == SUPERBLOCKNUM)
+	{
+		return REGIONSUPERBLOCK;
+	}
+	if (blockNum == INODEBIMBLOCKNUM)
+	{
+		return REGIONINODEBITMAP;
+	}
+	if (blockNum == DATABIMBLOCKNUM)
+	{
+		return REGIONDATABITMAP;
+	}
+	if (blockNum < FIRSTDATABLOCKNUM)
+	{
+		return REGIONINODETABLE;
+	}
+	return REGIONDATA;
+}
+
+// ? ############################## BEGIN REPAIR OVERLAY ##############################
+
+// From here on every handle opened on this image reads and writes the overlay. All phases are due.
+void beginRepairOverlay(char *image)
+{
+	struct stat st;
+	if (stat(image, &st) != 0)
+	{
+		// Nothing to overlay, the phases report the open error themselves
+		return;
+	}
+	repairOverlay.isActive = 1;
+	repairOverlay.device = st.st_dev;
+	repairOverlay.inode = st.st_ino;
+	memset(repairOverlay.dirty, 0, sizeof(repairOverlay.dirty));
+	repairOverlay.duePhases = (1u << NUMREPAIRPHASES) - 1;
+}
+
+// ? ############################## IS OVERLAY TARGET ##############################
+
+int isOverlayTarget(int fd)
+{
+	struct stat st;
+	return repairOverlay.isActive && fstat(fd, &st) == 0 && st.st_dev == repairOverlay.device &&
+		   st.st_ino == repairOverlay.inode;
+}
+
+// ? ############################## IS OVERLAY DIRTY ##############################
+
+int isOverlayDirty(uint32_t blockNum)
+{
+	return repairOverlay.isActive && blockNum < TOTALBLOCKS && bitCheck(repairOverlay.dirty, blockNum);
+}
+
+// Loads a block into the overlay on its first write. Caller holds repairOverlay.lock.
+static unsigned char *overlayBlock(int fd, uint32_t blockNum)
+{
+	if (repairOverlay.blocks[blockNum] == NULL)
+	{
+		unsigned char *copy = malloc(BLOCKSIZE);
+		if (copy == NULL)
+		{
+			return NULL;
+		}
+		readImageBlock(fd, blockNum, copy);
+		repairOverlay.blocks[blockNum] = copy;
+	}
+	return repairOverlay.blocks[blockNum];
+}
+
+// ? ############################## READ OVERLAY BLOCK ##############################
+
+// Serves a repaired block. Repairs only run between the walks, so the dirty bits readBlock tests
+// without the lock never change while walker threads read.
+void readOverlayBlock(int fd, uint32_t blockNum, unsigned char *buffer)
+{
+	pthread_mutex_lock(&repairOverlay.lock);
+	unsigned char *copy = repairOverlay.blocks[blockNum];
+	if (copy != NULL)
+	{
+		memcpy(buffer, copy, BLOCKSIZE);
+	}
+	pthread_mutex_unlock(&repairOverlay.lock);
+	if (copy == NULL)
+	{
+		readImageBlock(fd, blockNum, buffer);
+	}
+}
+
+// ? ############################## WRITE OVERLAY BLOCK ##############################
+
+// A write that changes nothing is dropped, so a phase rewriting what it read does not keep the loop going
+void writeOverlayBlock(int fd, uint32_t blockNum, const unsigned char *buffer)
+{
+	pthread_mutex_lock(&repairOverlay.lock);
+	unsigned char *copy = overlayBlock(fd, blockNum);
+	if (copy == NULL)
+	{
+		pthread_mutex_unlock(&repairOverlay.lock);
+		printf("Error: Out of memory keeping repaired block %u in memory.\n", blockNum);
+		return;
+	}
+	if (memcmp(copy, buffer, BLOCKSIZE) == 0 && !bitCheck(repairOverlay.dirty, blockNum))
+	{
+		// Still the image contents, nothing to keep
+		free(copy);
+		repairOverlay.blocks[blockNum] = NULL;
+	}
+	else if (memcmp(copy, buffer, BLOCKSIZE) != 0)
+	{
+		memcpy(copy, buffer, BLOCKSIZE);
+		setBit(repairOverlay.dirty, blockNum);
+
+		uint32_t region = blockRegion(blockNum);
+		if (region & (REGIONINODETABLE | REGIONDATA))
+		{
+			// The trees may differ from what the last data bitmap walk laid out
+			walkLayouts.isCurrent = 0;
+		}
+		for (int phase = 0; phase < NUMREPAIRPHASES; phase++)
+		{
+			if (repairPhaseRegions[phase] & region)
+			{
+				repairOverlay.duePhases |= 1u << phase;
+			}
+		}
+	}
+	pthread_mutex_unlock(&repairOverlay.lock);
+}
+
+// ? ############################## TAKE REPAIR PHASE ##############################
+
+// Whether a phase has to run this round. Its own repairs make it due again, so each fix is re-verified.
+int takeRepairPhase(int phase)
+{
+	if (!repairOverlay.isActive)
+	{
+		return 1;
+	}
+	int isDue = (repairOverlay.duePhases >> phase) & 1;
+	repairOverlay.duePhases &= ~(1u << phase);
+	return isDue;
+}
+
+int isAnyRepairPhaseDue(void)
+{
+	return repairOverlay.isActive && repairOverlay.duePhases != 0;
+}
+
+// ? ############################## COMMIT REPAIR OVERLAY ##############################
+
+// Writes the repaired blocks through the undo log. File contents and pointer blocks go first and the
+// superblock last, so an interrupted commit never leaves metadata pointing at blocks not yet written.
+int commitRepairOverlay(char *image)
+{
+	if (!repairOverlay.isActive)
+	{
+		return 0;
+	}
+	repairOverlay.isActive = 0;
+
+	int committed = 0;
+	int fd = openImage(image, O_RDWR);
+	if (fd < 0)
+	{
+		printf("Error: Cannot open image %s to write the repairs.\n", image);
+		endRepairOverlay();
+		return -1;
+	}
+	static const uint32_t commitOrder[][2] = {
+		{FIRSTDATABLOCKNUM, LASTDATABLOCKNUM},
+		{INODETABSBLOCKNUM, FIRSTDATABLOCKNUM - 1},
+		{DATABIMBLOCKNUM, DATABIMBLOCKNUM},
+		{INODEBIMBLOCKNUM, INODEBIMBLOCKNUM},
+		{SUPERBLOCKNUM, SUPERBLOCKNUM},
+	};
+	for (size_t r = 0; r < sizeof(commitOrder) / sizeof(commitOrder[0]); r++)
+	{
+		for (uint32_t b = commitOrder[r][0]; b <= commitOrder[r][1]; b++)
+		{
+			if (bitCheck(repairOverlay.dirty, b) && !undoLogFailed)
+			{
+				writeBlock(fd, b, repairOverlay.blocks[b]);
+				committed++;
+			}
+		}
+	}
+	if (undoLogFailed)
+	{
+		// The block the log could not take was not written, nor any after it
+		fdatasync(fd);
+		closeImage(fd);
+		endRepairOverlay();
+		return -1;
+	}
+	if (committed > 0)
+	{
+		fdatasync(fd);
+	}
+	closeImage(fd);
+	endRepairOverlay();
+	return committed;
+}
+
+// ? ############################## END REPAIR OVERLAY ##############################
+
+// Drops the overlay, and with it every repair not committed yet
+void endRepairOverlay(void)
+{
+	pthread_mutex_lock(&repairOverlay.lock);
+	repairOverlay.isActive = 0;
+	for (uint32_t b = 0; b < TOTALBLOCKS; b++)
+	{
+		free(repairOverlay.blocks[b]);
+		repairOverlay.blocks[b] = NULL;
+	}
+	memset(repairOverlay.dirty, 0, sizeof(repairOverlay.dirty));
+	repairOverlay.duePhases = 0;
+	pthread_mutex_unlock(&repairOverlay.lock);
+}
+
+// ! ############################## Image Access ##############################
+
+// ? ############################## DIRECT TRANSFERS ##############################
+
+// O_DIRECT wants buffer, offset and length aligned; callers pass block-aligned buffers
+static void preadDirect(int fd, uint32_t firstBlock, uint32_t count, unsigned char *buffer)
+{
+	size_t length = (size_t)count * BLOCKSIZE;
+	ssize_t got = pread(fd, buffer, length, (off_t)firstBlock * BLOCKSIZE);
+	if (got < (ssize_t)length)
+	{
+		memset(buffer + (got > 0 ? got : 0), 0, length - (got > 0 ? got : 0));
+	}
+}
+
+// ? ############################## LOAD DIRECT IMAGE ##############################
+
+// Finds the caches of the image behind fd, filling them on its first open. Each image is read into
+// them once per run, however often the phases reopen it. NULL when every slot is taken.
+static DirectImage *loadDirectImage(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		return NULL;
+	}
+	DirectImage *unused = NULL;
+	for (int i = 0; i < MAXDIRECTIMAGES; i++)
+	{
+		DirectImage *candidate = &directImages[i];
+		if (candidate->isLoaded && candidate->device == st.st_dev && candidate->inode == st.st_ino)
+		{
+			return candidate;
+		}
+		if (!candidate->isLoaded && unused == NULL)
+		{
+			unused = candidate;
+		}
+	}
+	if (unused == NULL)
+	{
+		return NULL;
+	}
+
+	DirectImage *image = unused;
+	image->metaBlocks = FIRSTDATABLOCKNUM;
+	if (posix_memalign((void **)&image->metaCache, BLOCKSIZE, (size_t)image->metaBlocks * BLOCKSIZE) != 0 ||
+		posix_memalign((void **)&image->pointerCache, BLOCKSIZE, (size_t)POINTERCACHESLOTS * BLOCKSIZE) != 0)
+	{
+		printf("Error: Could not allocate direct I/O caches.\n");
+		exit(1);
+	}
+	preadDirect(fd, 0, image->metaBlocks, image->metaCache);
+	memset(image->pointerCacheTags, 0, sizeof(image->pointerCacheTags));
+	pthread_mutex_init(&image->cacheLock, NULL);
+	image->device = st.st_dev;
+	image->inode = st.st_ino;
+	image->isLoaded = 1;
+	return image;
+}
+
+int isDirectImage(int fd)
+{
+	return fd >= 0 && fd < MAXIMAGEHANDLES && imageHandles[fd].direct != NULL;
+}
+
+// Only blocks the data bitmap walk marked as pointer blocks are worth caching, data is read once
+static int isCachedPointerBlock(uint32_t blockNum)
+{
+	return blockNum < TOTALBLOCKS &&
+		   ((__atomic_load_n(&blockState[PLANEPOINTERBLOCK][blockNum / 64], __ATOMIC_RELAXED) >> (blockNum % 64)) & 1);
+}
+
+void readDirectBlock(int fd, uint32_t blockNum, unsigned char *buffer)
+{
+	DirectImage *image = imageHandles[fd].direct;
+	if (blockNum < image->metaBlocks)
+	{
+		memcpy(buffer, image->metaCache + ((size_t)blockNum * BLOCKSIZE), BLOCKSIZE);
+		return;
+	}
+
+	int isPointerBlock = isCachedPointerBlock(blockNum);
+	uint32_t slot = blockNum % POINTERCACHESLOTS;
+	if (isPointerBlock)
+	{
+		pthread_mutex_lock(&image->cacheLock);
+		int hit = (image->pointerCacheTags[slot] == blockNum + 1);
+		if (hit)
+		{
+			memcpy(buffer, image->pointerCache + ((size_t)slot * BLOCKSIZE), BLOCKSIZE);
+		}
+		pthread_mutex_unlock(&image->cacheLock);
+		if (hit)
+		{
+			return;
+		}
+	}
+
+	_Alignas(BLOCKSIZE) unsigned char bounce[BLOCKSIZE];
+	unsigned char *target = ((uintptr_t)buffer % BLOCKSIZE == 0) ? buffer : bounce;
+	preadDirect(fd, blockNum, 1, target);
+	if (target != buffer)
+	{
+		memcpy(buffer, target, BLOCKSIZE);
+	}
+
+	if (isPointerBlock)
+	{
+		pthread_mutex_lock(&image->cacheLock);
+		memcpy(image->pointerCache + ((size_t)slot * BLOCKSIZE), buffer, BLOCKSIZE);
+		image->pointerCacheTags[slot] = blockNum + 1;
+		pthread_mutex_unlock(&image->cacheLock);
+	}
+}
+
+// Writes go straight to the image and refresh whatever copy of the block the caches hold
+int writeDirectBlock(int fd, uint32_t blockNum, const unsigned char *buffer)
+{
+	DirectImage *image = imageHandles[fd].direct;
+	_Alignas(BLOCKSIZE) unsigned char bounce[BLOCKSIZE];
+	const unsigned char *source = buffer;
+	if ((uintptr_t)buffer % BLOCKSIZE != 0)
+	{
+		memcpy(bounce, buffer, BLOCKSIZE);
+		source = bounce;
+	}
+	if (pwrite(fd, source, BLOCKSIZE, (off_t)blockNum * BLOCKSIZE) != BLOCKSIZE)
+	{
+		// The caches keep what the disk still holds
+		return -1;
+	}
+
+	if (blockNum < image->metaBlocks)
+	{
+		memcpy(image->metaCache + ((size_t)blockNum * BLOCKSIZE), buffer, BLOCKSIZE);
+		return 0;
+	}
+	uint32_t slot = blockNum % POINTERCACHESLOTS;
+	pthread_mutex_lock(&image->cacheLock);
+	if (image->pointerCacheTags[slot] == blockNum + 1)
+	{
+		memcpy(image->pointerCache + ((size_t)slot * BLOCKSIZE), buffer, BLOCKSIZE);
+	}
+	pthread_mutex_unlock(&image->cacheLock);
+	return 0;
+}
+
+// ? ############################## LOAD SPARSE IMAGE ##############################
+
+// Asks the file system, via SEEK_DATA/SEEK_HOLE, which ranges of the image behind fd are holes. Each
+// image is scanned once per run, however often the phases reopen it. NULL for an empty image or
+// when every slot is taken.
+static SparseImage *loadSparseImage(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		return NULL;
+	}
+	SparseImage *unused = NULL;
+	for (int i = 0; i < MAXSPARSEIMAGES; i++)
+	{
+		SparseImage *candidate = &sparseImages[i];
+		if (candidate->isLoaded && candidate->device == st.st_dev && candidate->inode == st.st_ino)
+		{
+			return candidate;
+		}
+		if (!candidate->isLoaded && unused == NULL)
+		{
+			unused = candidate;
+		}
+	}
+	if (unused == NULL)
+	{
+		return NULL;
+	}
+
+	SparseImage *image = unused;
+	image->numBlocks = (uint32_t)((st.st_size + BLOCKSIZE - 1) / BLOCKSIZE);
+	image->holeMap = calloc((image->numBlocks + 7) / 8, 1);
+
+	off_t offset = 0;
+	while (offset < st.st_size)
+	{
+		off_t dataStart = lseek(fd, offset, SEEK_DATA);
+		if (dataStart < 0 && errno != ENXIO)
+		{
+			// SEEK_DATA not supported here, treat the whole image as data
+			free(image->holeMap);
+			image->holeMap = NULL;
+			break;
+		}
+		off_t holeEnd = dataStart < 0 ? st.st_size : dataStart;
+
+		// Only blocks lying completely inside [offset, holeEnd) are holes
+		for (off_t b = (offset + BLOCKSIZE - 1) / BLOCKSIZE; (b + 1) * BLOCKSIZE <= holeEnd; b++)
+		{
+			setBit(image->holeMap, (int)b);
+		}
+		if (dataStart < 0)
+		{
+			break;
+		}
+
+		offset = lseek(fd, dataStart, SEEK_HOLE);
+		if (offset < 0)
+		{
+			break;
+		}
+	}
+	lseek(fd, 0, SEEK_SET);
+	image->device = st.st_dev;
+	image->inode = st.st_ino;
+	image->isLoaded = 1;
+	return image;
+}
+
+// ? ############################## OPEN IMAGE ##############################
+
+// Opens an image and looks up which ranges of it are holes. readBlock serves blocks inside holes as
+// zeros without touching the disk, so a huge and mostly empty sparse image costs time proportional
+// to its real data.
+//
+// With --direct the image is opened with O_DIRECT so a check does not push other workloads out of
+// the page cache. The metadata blocks in front of the data region are then read in one aligned
+// transfer, and only pointer blocks, which the phases revisit, are kept in a small cache. Both
+// belong to the image rather than the handle, so later phases start with them warm.
+int openImage(char *image, int flags)
+{
+	int fd = -1;
+	DirectImage *direct = NULL;
+	int isCompressed = isZstdImageFile(image);
+	if (directIOEnabled && !isCompressed)
+	{
+		fd = open(image, flags | O_DIRECT);
+		direct = fd >= 0 && fd < MAXIMAGEHANDLES ? loadDirectImage(fd) : NULL;
+		if (fd >= 0 && direct == NULL)
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0)
+	{
+		// Not every file system takes O_DIRECT, the buffered path still works there. Compressed
+		// images are never written.
+		fd = open(image, isCompressed ? O_RDONLY : flags);
+	}
+	if (fd < 0 || fd >= MAXIMAGEHANDLES)
+	{
+		return fd;
+	}
+
+	ImageHandle *handle = &imageHandles[fd];
+	memset(handle, 0, sizeof(*handle));
+	handle->isOpen = 1;
+	handle->isOverlaid = isOverlayTarget(fd);
+	if (isCompressed)
+	{
+		// Blocks come out of the frame index, there are no holes to look for
+#ifdef VSFSCK_WITH_ZSTD
+		handle->compressed = loadCompressedImage(fd);
+#endif
+		if (handle->compressed == NULL)
+		{
+			closeImage(fd);
+			return -1;
+		}
+		return fd;
+	}
+	handle->direct = direct;
+	handle->sparse = loadSparseImage(fd);
+	return fd;
+}
+
+// ? ############################## CLOSE IMAGE ##############################
+
+void closeImage(int fd)
+{
+	if (fd >= 0 && fd < MAXIMAGEHANDLES)
+	{
+		memset(&imageHandles[fd], 0, sizeof(imageHandles[fd]));
+	}
+	close(fd);
+}
+
+// ? ############################## IS BLOCK HOLE ##############################
+
+// A pointer landing in a hole is a strong corruption signal: the block it names was never written
+int isBlockHole(int fd, uint32_t blockNum)
+{
+	SparseImage *sparse = (fd >= 0 && fd < MAXIMAGEHANDLES) ? imageHandles[fd].sparse : NULL;
+	if (sparse == NULL || sparse->holeMap == NULL || blockNum >= sparse->numBlocks)
+	{
+		return 0;
+	}
+	if (imageHandles[fd].isOverlaid && isOverlayDirty(blockNum))
+	{
+		// Written by a repair of this run, it only lives in the overlay so far
+		return 0;
+	}
+	return bitCheck(sparse->holeMap, blockNum);
+}
+
+// ? ############################## NOTE BLOCKS DISCARDED ##############################
+
+// Blocks [firstBlock, firstBlock + count) were punched out or zeroed behind readBlock's back: punched
+// ones read as holes from now on, and no cached copy of either may be served again
+void noteBlocksDiscarded(int fd, uint32_t firstBlock, uint32_t count, int isHole)
+{
+	if (fd < 0 || fd >= MAXIMAGEHANDLES)
+	{
+		return;
+	}
+	ImageHandle *handle = &imageHandles[fd];
+	for (uint32_t b = firstBlock; b < firstBlock + count; b++)
+	{
+		if (isHole && handle->sparse != NULL && handle->sparse->holeMap != NULL && b < handle->sparse->numBlocks)
+		{
+			setBit(handle->sparse->holeMap, b);
+		}
+		if (handle->direct != NULL && handle->direct->pointerCacheTags[b % POINTERCACHESLOTS] == b + 1)
+		{
+			handle->direct->pointerCacheTags[b % POINTERCACHESLOTS] = 0;
+		}
+	}
+}
+
+// ! ############################## Run Arena ##############################
+
+// ? ############################## ARENA ALLOC ##############################
+
+// All scratch memory of a check comes from one arena. Functions take a mark on entry and release
+// back to it on exit, released chunks are kept for reuse, and everything is freed in bulk when the
+// check ends, so no allocator calls happen once the first chunk exists.
+void *arenaAlloc(Arena *arena, size_t size, size_t alignment)
+{
+	ArenaChunk *chunk = arena->current;
+	if (chunk != NULL)
+	{
+		size_t start = (chunk->used + alignment - 1) & ~(alignment - 1);
+		if (start + size <= chunk->capacity)
+		{
+			chunk->used = start + size;
+			return chunk->memory + start;
+		}
+	}
+
+	// Current chunk is full. Reuse a spare one if it is big enough, else make a new one
+	ArenaChunk *fresh = arena->spare;
+	if (fresh != NULL && fresh->capacity >= size)
+	{
+		arena->spare = fresh->previous;
+	}
+	else
+	{
+		fresh = malloc(sizeof(ArenaChunk));
+		fresh->capacity = size > ARENACHUNKSIZE ? size : ARENACHUNKSIZE;
+		if (posix_memalign((void **)&fresh->memory, BLOCKSIZE, fresh->capacity) != 0)
+		{
+			printf("Error: Out of memory allocating %zu bytes of scratch space.\n", fresh->capacity);
+			exit(1);
+		}
+	}
+	fresh->used = size;
+	fresh->previous = arena->current;
+	arena->current = fresh;
+	return fresh->memory;
+}
+
+// Chunks are BLOCKSIZE aligned, so a block-aligned allocation is always suitable for direct I/O
+unsigned char *arenaAllocBlock(Arena *arena)
+{
+	return (unsigned char *)arenaAlloc(arena, BLOCKSIZE, BLOCKSIZE);
+}
+
+// ? ############################## ARENA MARK / RELEASE ##############################
+
+ArenaMark arenaMark(Arena *arena)
+{
+	ArenaMark mark;
+	mark.chunk = arena->current;
+	mark.used = arena->current != NULL ? arena->current->used : 0;
+	return mark;
+}
+
+void arenaRelease(Arena *arena, ArenaMark mark)
+{
+	while (arena->current != NULL && arena->current != mark.chunk)
+	{
+		ArenaChunk *chunk = arena->current;
+		arena->current = chunk->previous;
+		chunk->previous = arena->spare;
+		arena->spare = chunk;
+	}
+	if (arena->current != NULL)
+	{
+		arena->current->used = mark.used;
+	}
+}
+
+// ? ############################## ARENA FREE ##############################
+
+void arenaFree(Arena *arena)
+{
+	arenaRelease(arena, (ArenaMark){NULL, 0});
+	while (arena->spare != NULL)
+	{
+		ArenaChunk *chunk = arena->spare;
+		arena->spare = chunk->previous;
+		free(chunk->memory);
+		free(chunk);
+	}
+	free(arena->depthScratch);
+	arena->depthScratch = NULL;
+}
+
+// ? ############################## WALKER SCRATCH BLOCK ##############################
+
+// The tree walkers hold one pointer block per level of an indirect tree at a time, so each depth
+// (1 = block of data pointers, 3 = triple indirect block) owns a fixed buffer for the whole run.
+// The pool lives outside the bump region so marks and releases never touch it.
+unsigned char *walkerScratchBlock(int depth)
+{
+	if (runArena.depthScratch == NULL)
+	{
+		if (posix_memalign((void **)&runArena.depthScratch, BLOCKSIZE, (MAXTREEDEPTH + 1) * BLOCKSIZE) != 0)
+		{
+			printf("Error: Out of memory allocating tree walker scratch space.\n");
+			exit(1);
+		}
+	}
+	return runArena.depthScratch + (depth * BLOCKSIZE);
+}
+
+// ! ############################## Block State Table ##############################
+
+// ? ############################## SET / TEST BLOCK STATE ##############################
+
+void setBlockState(int plane, uint32_t blockNum)
+{
+	blockState[plane][blockNum / 64] |= (uint64_t)1 << (blockNum % 64);
+}
+
+int testBlockState(int plane, uint32_t blockNum)
+{
+	return (blockState[plane][blockNum / 64] >> (blockNum % 64)) & 1;
+}
+
+void clearBlockPlane(int plane)
+{
+	memset(blockState[plane], 0, sizeof(blockState[plane]));
+}
+
+// ? ############################## BLOCK RANGE MASK ##############################
+
+// Bits of plane word `word` that fall inside the block range [firstBlock, lastBlock]
+uint64_t blockRangeMask(uint32_t word, uint32_t firstBlock, uint32_t lastBlock)
+{
+	uint32_t wordFirst = word * 64;
+	uint32_t wordLast = wordFirst + 63;
+	if (lastBlock < wordFirst || firstBlock > wordLast)
+	{
+		return 0;
+	}
+	uint64_t mask = ~(uint64_t)0;
+	if (firstBlock > wordFirst)
+	{
+		mask &= ~(uint64_t)0 << (firstBlock - wordFirst);
+	}
+	if (lastBlock < wordLast)
+	{
+		mask &= ~(uint64_t)0 >> (wordLast - lastBlock);
+	}
+	return mask;
+}
+
+// ? ############################## LOAD / STORE BITMAP PLANE ##############################
+
+// On-disk bitmaps count from the first block they describe, planes count from block 0
+void loadBitmapPlane(int plane, const unsigned char *bitMap, uint32_t firstBlock, uint32_t lastBlock)
+{
+	clearBlockPlane(plane);
+	for (uint32_t blockNum = firstBlock; blockNum <= lastBlock && blockNum < TOTALBLOCKS; blockNum++)
+	{
+		if (bitCheck(bitMap, blockNum - firstBlock))
+		{
+			setBlockState(plane, blockNum);
+		}
+	}
+}
+
+void storeBitmapPlane(int plane, unsigned char *bitMap, uint32_t firstBlock, uint32_t lastBlock)
+{
+	for (uint32_t blockNum = firstBlock; blockNum <= lastBlock && blockNum < TOTALBLOCKS; blockNum++)
+	{
+		if (testBlockState(plane, blockNum))
+		{
+			setBit(bitMap, blockNum - firstBlock);
+		}
+		else
+		{
+			removeBit(bitMap, blockNum - firstBlock);
+		}
+	}
+}
+
+// ! ############################## Parallel Block Walk ##############################
+
+// ? ############################## WALK TASK DEQUE ##############################
+
+// Each worker owns a deque of tasks. The owner works depth first from the tail, thieves take the
+// oldest and usually largest task from the head. outstandingTasks counts queued and running tasks,
+// it is raised before a task becomes visible so the walk cannot look finished while one is in flight.
+void pushWalkTask(WalkWorker *worker, const WalkTask *task)
+{
+	atomic_fetch_add_explicit(&worker->pool->outstandingTasks, 1, memory_order_relaxed);
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail == worker->capacity)
+	{
+		uint32_t queued = worker->tail - worker->head;
+		if (worker->head > 0)
+		{
+			memmove(worker->tasks, worker->tasks + worker->head, queued * sizeof(WalkTask));
+		}
+		else
+		{
+			worker->capacity = worker->capacity ? worker->capacity * 2 : 64;
+			worker->tasks = realloc(worker->tasks, worker->capacity * sizeof(WalkTask));
+		}
+		worker->head = 0;
+		worker->tail = queued;
+	}
+	worker->tasks[worker->tail++] = *task;
+	pthread_mutex_unlock(&worker->lock);
+
+	WalkPool *pool = worker->pool;
+	pthread_mutex_lock(&pool->idleLock);
+	atomic_fetch_add(&pool->pushGeneration, 1);
+	pthread_cond_signal(&pool->workAvailable);
+	pthread_mutex_unlock(&pool->idleLock);
+}
+
+static int popWalkTask(WalkWorker *worker, WalkTask *task)
+{
+	int found = 0;
+	pthread_mutex_lock(&worker->lock);
+	if (worker->tail > worker->head)
+	{
+		*task = worker->tasks[--worker->tail];
+		found = 1;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return found;
+}
+
+static int stealWalkTask(WalkWorker *thief, WalkTask *task)
+{
+	WalkPool *pool = thief->pool;
+	for (int k = 1; k < pool->numWorkers; k++)
+	{
+		WalkWorker *victim = &pool->workers[(thief->index + k) % pool->numWorkers];
+		int found = 0;
+		pthread_mutex_lock(&victim->lock);
+		if (victim->tail > victim->head)
+		{
+			*task = victim->tasks[victim->head++];
+			found = 1;
+		}
+		pthread_mutex_unlock(&victim->lock);
+		if (found)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// ? ############################## WALK REPORT ##############################
+
+// Findings of a walk on the main thread print immediately. On the pool they are kept with the
+// inode and logical block they concern and printed after the join, so the output does not depend
+// on the number of workers or on which worker stole what.
+void walkReport(WalkContext *walk, uint64_t logicalKey, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	if (walk->isQuiet)
+	{
+		va_end(args);
+		return;
+	}
+	if (walk->worker == NULL)
+	{
+		vprintf(format, args);
+		va_end(args);
+		return;
+	}
+
+	WalkWorker *worker = walk->worker;
+	if (worker->messageCount == worker->messageCapacity)
+	{
+		worker->messageCapacity = worker->messageCapacity ? worker->messageCapacity * 2 : 32;
+		worker->messages = realloc(worker->messages, worker->messageCapacity * sizeof(WalkMessage));
+	}
+	WalkMessage *message = &worker->messages[worker->messageCount];
+	message->inodeNum = walk->inodeNum;
+	message->logicalKey = logicalKey;
+	message->sequence = worker->messageCount++;
+	vsnprintf(message->text, sizeof(message->text), format, args);
+	va_end(args);
+}
+
+static int compareWalkMessages(const void *a, const void *b)
+{
+	const WalkMessage *x = a;
+	const WalkMessage *y = b;
+	if (x->inodeNum != y->inodeNum)
+	{
+		return x->inodeNum < y->inodeNum ? -1 : 1;
+	}
+	if (x->logicalKey != y->logicalKey)
+	{
+		return x->logicalKey < y->logicalKey ? -1 : 1;
+	}
+	return x->sequence < y->sequence ? -1 : (x->sequence > y->sequence);
+}
+
+// Pre-order is logical order, a pointer block sharing its first logical block with its first child
+// coming ahead of it
+static int compareLayoutEntries(const void *a, const void *b)
+{
+	const LayoutEntry *x = a;
+	const LayoutEntry *y = b;
+	if (x->logical != y->logical)
+	{
+		return x->logical < y->logical ? -1 : 1;
+	}
+	return x->level > y->level ? -1 : (x->level < y->level);
+}
+
+// ? ############################## WALK WORKER ##############################
+
+static void runWalkTask(WalkWorker *worker, const WalkTask *task)
+{
+	WalkPool *pool = worker->pool;
+	WalkContext walk = {.fd = pool->fd,
+						.inodeNum = task->inodeNum,
+						.isInodeValid = task->isInodeValid,
+						.worker = worker,
+						.layout = pool->layouts != NULL ? &pool->layouts[task->inodeNum] : NULL};
+	if (task->kind == WALKTASKINODE)
+	{
+		collectBlocksForInode(&walk, (Inode *)task->inode);
+	}
+	else
+	{
+		walkPointerRange(&walk, task->block, task->level, task->logicalBase, task->first, task->end);
+	}
+}
+
+// A worker that found every deque empty sleeps until a task is pushed after it last looked, or the
+// walk is over. generation is the push count read before looking, so a push it missed wakes it at
+// once. The main thread wakes up regularly anyway to print status lines.
+static void parkWalkWorker(WalkWorker *self, unsigned generation)
+{
+	WalkPool *pool = self->pool;
+	pthread_mutex_lock(&pool->idleLock);
+	while (atomic_load(&pool->pushGeneration) == generation &&
+		   atomic_load_explicit(&pool->outstandingTasks, memory_order_acquire) > 0)
+	{
+		if (self->index != 0)
+		{
+			pthread_cond_wait(&pool->workAvailable, &pool->idleLock);
+			continue;
+		}
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += WALKIDLEPOLLMS * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		if (pthread_cond_timedwait(&pool->workAvailable, &pool->idleLock, &deadline) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->idleLock);
+}
+
+static void *walkWorkerMain(void *arg)
+{
+	WalkWorker *self = arg;
+	WalkPool *pool = self->pool;
+	WalkTask task;
+
+	while (atomic_load_explicit(&pool->outstandingTasks, memory_order_acquire) > 0)
+	{
+		// Only the main thread prints the status line
+		if (self->index == 0)
+		{
+			pollCheckStatus();
+		}
+		unsigned generation = atomic_load(&pool->pushGeneration);
+		if (!popWalkTask(self, &task) && !stealWalkTask(self, &task))
+		{
+			parkWalkWorker(self, generation);
+			continue;
+		}
+		// A cancelled walk drains its queues without reading further
+		if (!isCheckCancelled())
+		{
+			runWalkTask(self, &task);
+		}
+		if (atomic_fetch_sub_explicit(&pool->outstandingTasks, 1, memory_order_acq_rel) == 1)
+		{
+			// The walk is over, release everyone still parked
+			pthread_mutex_lock(&pool->idleLock);
+			pthread_cond_broadcast(&pool->workAvailable);
+			pthread_mutex_unlock(&pool->idleLock);
+		}
+	}
+	return NULL;
+}
+
+// ? ############################## COLLECT BLOCKS IN PARALLEL ##############################
+
+// Walks the block trees of the given inodes on numWorkers threads, the main thread being worker 0.
+// Inodes are dealt out round robin, upper tree levels are split so idle workers can steal them.
+// When layouts is set, the trees of valid inodes are recorded there, grown in layoutArena.
+void collectBlocksInParallel(int fd, Inode *inodes, uint32_t *inodeNums, uint32_t count, int numWorkers,
+							 InodeLayout *layouts, Arena *layoutArena)
+{
+	WalkPool pool;
+	pool.fd = fd;
+	pool.numWorkers = numWorkers;
+	pool.layouts = layouts;
+	atomic_init(&pool.outstandingTasks, 0);
+	atomic_init(&pool.pushGeneration, 0);
+	pthread_mutex_init(&pool.idleLock, NULL);
+	pthread_cond_init(&pool.workAvailable, NULL);
+	pool.workers = calloc(numWorkers, sizeof(WalkWorker));
+	if (pool.workers == NULL)
+	{
+		printf("Error: Could not allocate walk workers.\n");
+		exit(1);
+	}
+
+	for (int w = 0; w < numWorkers; w++)
+	{
+		WalkWorker *worker = &pool.workers[w];
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->pool = &pool;
+		worker->index = w;
+		if (posix_memalign((void **)&worker->scratch, BLOCKSIZE, (MAXTREEDEPTH + 1) * BLOCKSIZE) != 0)
+		{
+			printf("Error: Could not allocate walk scratch buffers.\n");
+			exit(1);
+		}
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		WalkTask task = {WALKTASKINODE, inodeNums[i], 0, &inodes[i], 0, 0, 0, 0, 0};
+		pushWalkTask(&pool.workers[i % numWorkers], &task);
+	}
+
+	pthread_t *threads = calloc(numWorkers, sizeof(pthread_t));
+	int started = 1;
+	for (; started < numWorkers; started++)
+	{
+		if (pthread_create(&threads[started], NULL, walkWorkerMain, &pool.workers[started]) != 0)
+		{
+			// Fewer threads only means less stealing, worker 0 picks up whatever is left
+			break;
+		}
+	}
+	walkWorkerMain(&pool.workers[0]);
+	for (int w = 1; w < started; w++)
+	{
+		pthread_join(threads[w], NULL);
+	}
+
+	uint32_t totalMessages = 0;
+	for (int w = 0; w < numWorkers; w++)
+	{
+		totalMessages += pool.workers[w].messageCount;
+	}
+	WalkMessage *messages = malloc((totalMessages ? totalMessages : 1) * sizeof(WalkMessage));
+	uint32_t next = 0;
+	for (int w = 0; w < numWorkers; w++)
+	{
+		WalkWorker *worker = &pool.workers[w];
+		// A worker that found nothing never allocated its buffer, and memcpy must not see NULL
+		if (worker->messageCount > 0)
+		{
+			memcpy(messages + next, worker->messages, worker->messageCount * sizeof(WalkMessage));
+			next += worker->messageCount;
+		}
+		for (uint32_t k = 0; k < worker->layoutCount; k++)
+		{
+			const WalkLayoutEntry *recorded = &worker->layoutEntries[k];
+			recordBlockLayout(layoutArena, &layouts[recorded->inodeNum], recorded->entry.logical,
+							  recorded->entry.physical, (int)recorded->entry.level);
+		}
+		free(worker->layoutEntries);
+		free(worker->messages);
+		free(worker->tasks);
+		free(worker->scratch);
+		pthread_mutex_destroy(&worker->lock);
+	}
+	qsort(messages, totalMessages, sizeof(WalkMessage), compareWalkMessages);
+	for (uint32_t i = 0; i < totalMessages; i++)
+	{
+		fputs(messages[i].text, stdout);
+	}
+	for (uint32_t i = 0; layouts != NULL && i < count; i++)
+	{
+		InodeLayout *layout = &layouts[inodeNums[i]];
+		if (layout->count > 1)
+		{
+			qsort(layout->entries, layout->count, sizeof(LayoutEntry), compareLayoutEntries);
+		}
+	}
+
+	free(messages);
+	free(threads);
+	free(pool.workers);
+	pthread_cond_destroy(&pool.workAvailable);
+	pthread_mutex_destroy(&pool.idleLock);
+}
+
+// ! ############################## Clean State ##############################
+
+// ? ############################## COUNT BITMAP BITS ##############################
+
+uint32_t countBitmapBits(const unsigned char *bitMap, uint32_t numBytes)
+{
+	uint32_t count = 0;
+	uint32_t i = 0;
+	for (; i + sizeof(uint64_t) <= numBytes; i += sizeof(uint64_t))
+	{
+		uint64_t word;
+		memcpy(&word, bitMap + i, sizeof(word));
+		count += __builtin_popcountll(word);
+	}
+	for (; i < numBytes; i++)
+	{
+		count += __builtin_popcount(bitMap[i]);
+	}
+	return count;
+}
+
+// ? ############################## IS IMAGE MARKED CLEAN ##############################
+
+// The --fast path: reads only the superblock and the two bitmaps. The image is skipped when its
+// marker says clean, the superblock is consistent and both bitmaps still hold the number of set
+// bits the last clean check saw. Anything else is reported and escalates to the full check.
+int isImageMarkedClean(char *image)
+{
+	int fd = openImage(image, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	unsigned char *inodeBitmap = arenaAllocBlock(&runArena);
+	unsigned char *dataBitmap = arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
+	readBlock(fd, INODEBIMBLOCKNUM, inodeBitmap);
+	readBlock(fd, DATABIMBLOCKNUM, dataBitmap);
+	closeImage(fd);
+
+	const CleanStateMarker *marker = (const CleanStateMarker *)sbPTR->reserved;
+	const char *reason = NULL;
+	if (!isSuperblockConsistent(sbPTR))
+		reason = "superblock is inconsistent";
+	else if (marker->magic != CLEANSTATEMAGIC)
+		reason = "image has never been checked clean";
+	else if (!marker->cleanFlag)
+		reason = "image is not marked clean";
+	else if (marker->mountCount >= MAXMOUNTSBETWEENCHECKS)
+		reason = "maximum mount count since the last check reached";
+	else if (countBitmapBits(dataBitmap, BLOCKSIZE) != marker->usedDataBlocks)
+		reason = "data bitmap count differs from the last check";
+	else if (countBitmapBits(inodeBitmap, BLOCKSIZE) != marker->usedInodes)
+		reason = "inode bitmap count differs from the last check";
+
+	if (reason == NULL)
+	{
+		printf("%s: clean (check generation %u, %u inodes, %u data blocks in use). Skipping full check.\n",
+			   image, marker->lastCheckGeneration, marker->usedInodes, marker->usedDataBlocks);
+	}
+	else
+	{
+		printf("%s: %s. Running full check.\n", image, reason);
+	}
+	arenaRelease(&runArena, mark);
+	return reason == NULL;
+}
+
+// ? ############################## RECORD CHECK RESULT ##############################
+
+// Updates the clean state marker after a full check. A clean run bumps the check generation, resets
+// the mount count and records the bitmap counts; a run that found errors clears the clean flag.
+// This runs after the undo log is closed: the marker is bookkeeping, not a repair to roll back.
+void recordCheckResult(char *image, int isClean)
+{
+	int fd = openImage(image, O_RDWR);
+	if (fd < 0)
+	{
+		return;
+	}
+	ArenaMark mark = arenaMark(&runArena);
+	Superblock *sbPTR = (Superblock *)arenaAllocBlock(&runArena);
+	unsigned char *bitmapBuffer = arenaAllocBlock(&runArena);
+	readSuperblock(fd, sbPTR);
+	CleanStateMarker *marker = (CleanStateMarker *)sbPTR->reserved;
+
+	if (!isClean && (marker->magic != CLEANSTATEMAGIC || !marker->cleanFlag))
+	{
+		// Without a clean marker the image already counts as dirty, nothing to write
+		closeImage(fd);
+		arenaRelease(&runArena, mark);
+		return;
+	}
+	if (marker->magic != CLEANSTATEMAGIC)
+	{
+		memset(marker, 0, sizeof(*marker));
+		marker->magic = CLEANSTATEMAGIC;
+	}
+
+	marker->cleanFlag = isClean ? 1 : 0;
+	if (isClean)
+	{
+		marker->mountCount = 0;
+		marker->lastCheckGeneration++;
+		readBlock(fd, DATABIMBLOCKNUM, bitmapBuffer);
+		marker->usedDataBlocks = countBitmapBits(bitmapBuffer, BLOCKSIZE);
+		readBlock(fd, INODEBIMBLOCKNUM, bitmapBuffer);
+		marker->usedInodes = countBitmapBits(bitmapBuffer, BLOCKSIZE);
+	}
+	writeSuperblock(fd, sbPTR);
+	fdatasync(fd);
+
+	closeImage(fd);
+	arenaRelease(&runArena, mark);
+}
+
+// ! ############################## Fragmentation and Defragmentation ##############################
+
+// ? ############################## RECORD BLOCK LAYOUT ##############################
+
+void recordBlockLayout(Arena *arena, InodeLayout *layout, uint64_t logical, uint32_t physical, int level)
+{
+	if (layout->count == layout->capacity)
+	{
+		uint32_t newCapacity = layout->capacity ? layout->capacity * 2 : 16;
+		LayoutEntry *grown = arenaAlloc(arena, newCapacity * sizeof(LayoutEntry), sizeof(uint64_t));
+		if (layout->count > 0)
+		{
+			memcpy(grown, layout->entries, layout->count * sizeof(LayoutEntry));
+		}
+		layout->entries = grown;
+		layout->capacity = newCapacity;
+	}
+	LayoutEntry entry = {logical, physical, (uint32_t)level};
+	layout->entries[layout->count++] = entry;
+}
+
+// ? ############################## COLLECT IMAGE LAYOUT ##############################
+
+// Walks every inode that claims blocks once more, quietly, recording the layout of each valid
+// inode into layouts[inodeNum]. Blocks claimed only by deleted inodes end up in PLANEREFANY but
+// not PLANEREFVALID. Returns the number of valid inodes, listed in validInodes, or -1 when the
+// check was cancelled and the layouts are incomplete.
+int collectImageLayout(int fd, InodeLayout *layouts, uint32_t *validInodes)
+{
+	uint32_t inodesPerBlock = BLOCKSIZE / INODESIZE;
+	unsigned char *blockBuffer = arenaAllocBlock(&runArena);
+	int validCount = 0;
+
+	clearBlockPlane(PLANEREFVALID);
+	clearBlockPlane(PLANEREFANY);
+	clearBlockPlane(PLANEPOINTERBLOCK);
+	memset(layouts, 0, INODECOUNT * sizeof(InodeLayout));
+	for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
+	{
+		readInodeBlock(fd, INODETABSBLOCKNUM + i, blockBuffer);
+		InodeBlockMasks masks;
+		classifyInodeBlock(blockBuffer, inodesPerBlock, INODESIZE, &masks);
+		uint64_t pending = masks.valid | masks.deletedAllocated;
+		while (pending)
+		{
+			uint32_t j = __builtin_ctzll(pending);
+			pending &= pending - 1;
+			uint32_t inodeNum = (i * inodesPerBlock) + j;
+			int isValid = (masks.valid >> j) & 1;
+			WalkContext walk = {.fd = fd,
+								.inodeNum = inodeNum,
+								.layout = isValid ? &layouts[inodeNum] : NULL,
+								.layoutArena = &runArena,
+								.isQuiet = 1};
+			collectBlocksForInode(&walk, (Inode *)(blockBuffer + (j * INODESIZE)));
+			if (isValid)
+			{
+				validInodes[validCount++] = inodeNum;
+			}
+		}
+		if (isCheckCancelled())
+		{
+			return -1;
+		}
+	}
+	return validCount;
+}
+
+// ? ############################## REPORT FRAGMENTATION ##############################
+
+// A data extent is a run of logically consecutive data blocks stored back to back; pointer blocks
+// stored inline between them, as a sequential read meets them, do not break the run. A pointer
+// block is scattered when the block following it in the tree's pre-order is not stored right after it.
+static void measureLayout(const InodeLayout *layout, uint32_t *dataBlocks, uint32_t *extents, uint32_t *pointerBlocks, uint32_t *scattered)
+{
+	*dataBlocks = *extents = *pointerBlocks = *scattered = 0;
+	const LayoutEntry *previousData = NULL;
+	int isRunIntact = 0;
+	for (uint32_t k = 0; k < layout->count; k++)
+	{
+		const LayoutEntry *entry = &layout->entries[k];
+		int followsPrevious = (k > 0 && entry->physical == layout->entries[k - 1].physical + 1);
+		if (entry->level > 0)
+		{
+			(*pointerBlocks)++;
+			if (k + 1 == layout->count || layout->entries[k + 1].physical != entry->physical + 1)
+			{
+				(*scattered)++;
+			}
+			isRunIntact = isRunIntact && followsPrevious;
+			continue;
+		}
+		(*dataBlocks)++;
+		if (previousData == NULL || !isRunIntact || !followsPrevious || entry->logical != previousData->logical + 1)
+		{
+			(*extents)++;
+		}
+		previousData = entry;
+		isRunIntact = 1;
+	}
+}
+
+void reportFragmentation(char *image)
+{
+	int fd = openImage(image, O_RDONLY);
+	ArenaMark mark = arenaMark(&runArena);
+	InodeLayout *layouts = arenaAlloc(&runArena, INODECOUNT * sizeof(InodeLayout), sizeof(uint64_t));
+	uint32_t *validInodes = arenaAlloc(&runArena, INODECOUNT * sizeof(uint32_t), sizeof(uint32_t));
+	int validCount = collectImageLayout(fd, layouts, validInodes);
+	closeImage(fd);
+
+	printf("Fragmentation report\n");
+	printf("---------------------------------\n");
+	if (validCount < 0)
+	{
+		printf("Cancelled before every inode was measured.\n");
+		printf("---------------------------------\n");
+		printf("\n");
+		arenaRelease(&runArena, mark);
+		return;
+	}
+	uint32_t totalData = 0, totalExtents = 0, totalPointers = 0, totalScattered = 0, fragmentedFiles = 0;
+	for (int n = 0; n < validCount; n++)
+	{
+		uint32_t dataBlocks, extents, pointerBlocks, scattered;
+		measureLayout(&layouts[validInodes[n]], &dataBlocks, &extents, &pointerBlocks, &scattered);
+		if (dataBlocks == 0 && pointerBlocks == 0)
+		{
+			continue;
+		}
+		printf("Inode %u: %u data blocks in %u extents (average run %.1f), %u pointer blocks, %u scattered\n",
+			   validInodes[n], dataBlocks, extents, extents ? (double)dataBlocks / extents : 0.0, pointerBlocks, scattered);
+		totalData += dataBlocks;
+		totalExtents += extents;
+		totalPointers += pointerBlocks;
+		totalScattered += scattered;
+		if (extents > 1 || scattered > 0)
+		{
+			fragmentedFiles++;
+		}
+	}
+	printf("Image: %u data blocks in %u extents (average run %.1f), %u of %u pointer blocks scattered, %u fragmented files\n",
+		   totalData, totalExtents, totalExtents ? (double)totalData / totalExtents : 0.0, totalScattered, totalPointers, fragmentedFiles);
+	printf("---------------------------------\n");
+	printf("\n");
+	arenaRelease(&runArena, mark);
+}
+
+// ? ############################## DEFRAGMENT IMAGE ##############################
+
+// Offline relocation of a clean image. Files are laid out one after the other from the start of the
+// data region in inode order, each in its tree's pre-order, so every pointer block lands right
+// before the blocks it maps and data follows in logical order. Blocks claimed only by deleted
+// inodes stay where they are and are stepped around. The whole data region is staged in memory,
+// pointers are remapped there and only blocks whose contents change are written, each through the
+// undo log: an interrupted run is rolled back with --undo.
+int defragmentImage(char *image)
+{
+	int fd = openImage(image, O_RDWR);
+	ArenaMark mark = arenaMark(&runArena);
+	InodeLayout *layouts = arenaAlloc(&runArena, INODECOUNT * sizeof(InodeLayout), sizeof(uint64_t));
+	uint32_t *validInodes = arenaAlloc(&runArena, INODECOUNT * sizeof(uint32_t), sizeof(uint32_t));
+	int validCount = collectImageLayout(fd, layouts, validInodes);
+	if (validCount < 0)
+	{
+		printf("Defragmentation cancelled. Nothing was relocated.\n");
+		closeImage(fd);
+		arenaRelease(&runArena, mark);
+		return -1;
+	}
+
+	// newLocation[old] is where block old moves to, 0 when it does not belong to a valid inode.
+	// isPointerBlock comes from the same layouts: the pointer block plane also holds the stale
+	// pointer blocks of deleted inodes, and remapping one of those would rewrite a file's data.
+	uint32_t newLocation[TOTALBLOCKS];
+	unsigned char isPointerBlock[TOTALBLOCKS];
+	memset(newLocation, 0, sizeof(newLocation));
+	memset(isPointerBlock, 0, sizeof(isPointerBlock));
+	uint32_t next = FIRSTDATABLOCKNUM;
+	uint32_t moved = 0;
+	for (int n = 0; n < validCount; n++)
+	{
+		const InodeLayout *layout = &layouts[validInodes[n]];
+		for (uint32_t k = 0; k < layout->count; k++)
+		{
+			while (next <= LASTDATABLOCKNUM && testBlockState(PLANEREFANY, next) && !testBlockState(PLANEREFVALID, next))
+			{
+				next++;
+			}
+			if (next > LASTDATABLOCKNUM)
+			{
+				// More blocks than the data region holds, only a damaged image gets here
+				printf("Error: The files do not fit into the data region. Nothing was relocated.\n");
+				closeImage(fd);
+				arenaRelease(&runArena, mark);
+				return -1;
+			}
+			uint32_t oldBlock = layout->entries[k].physical;
+			newLocation[oldBlock] = next;
+			isPointerBlock[oldBlock] = layout->entries[k].level > 0;
+			if (oldBlock != next)
+			{
+				moved++;
+			}
+			next++;
+		}
+	}
+	if (moved == 0)
+	{
+		printf("Image is already laid out contiguously. Nothing to relocate.\n");
+		closeImage(fd);
+		arenaRelease(&runArena, mark);
+		return 0;
+	}
+	walkLayouts.isCurrent = 0;
+
+	// Stage the data region as it will look afterwards
+	uint32_t dataBlocks = TOTALBLOCKS - FIRSTDATABLOCKNUM;
+	unsigned char (*current)[BLOCKSIZE] = arenaAlloc(&runArena, (size_t)dataBlocks * BLOCKSIZE, BLOCKSIZE);
+	unsigned char (*staged)[BLOCKSIZE] = arenaAlloc(&runArena, (size_t)dataBlocks * BLOCKSIZE, BLOCKSIZE);
+	for (uint32_t b = FIRSTDATABLOCKNUM; b <= LASTDATABLOCKNUM; b++)
+	{
+		readBlock(fd, b, current[b - FIRSTDATABLOCKNUM]);
+	}
+	memcpy(staged, current, (size_t)dataBlocks * BLOCKSIZE);
+	for (uint32_t b = FIRSTDATABLOCKNUM; b <= LASTDATABLOCKNUM; b++)
+	{
+		uint32_t target = newLocation[b];
+		if (target == 0)
+		{
+			continue;
+		}
+		memcpy(staged[target - FIRSTDATABLOCKNUM], current[b - FIRSTDATABLOCKNUM], BLOCKSIZE);
+		if (isPointerBlock[b])
+		{
+			// The staged blocks are raw image bytes, decode the pointers for the remap only
+			uint32_t *pointers = (uint32_t *)staged[target - FIRSTDATABLOCKNUM];
+			swapLE32Words(pointers, POINTERSPBLOCK);
+			for (uint32_t i = 0; i < POINTERSPBLOCK; i++)
+			{
+				if (pointers[i] >= FIRSTDATABLOCKNUM && pointers[i] <= LASTDATABLOCKNUM && newLocation[pointers[i]] != 0)
+				{
+					pointers[i] = newLocation[pointers[i]];
+				}
+			}
+			swapLE32Words(pointers, POINTERSPBLOCK);
+		}
+	}
+
+	// Data and pointer blocks first, then the inodes pointing at them, then the bitmap
+	for (uint32_t b = FIRSTDATABLOCKNUM; b <= LASTDATABLOCKNUM; b++)
+	{
+		if (memcmp(staged[b - FIRSTDATABLOCKNUM], current[b - FIRSTDATABLOCKNUM], BLOCKSIZE) != 0)
+		{
+			writeBlock(fd, b, staged[b - FIRSTDATABLOCKNUM]);
+		}
+	}
+
+	uint32_t inodesPerBlock = BLOCKSIZE / INODESIZE;
+	unsigned char *blockBuffer = arenaAllocBlock(&runArena);
+	for (uint32_t i = 0; i < INODETABNUMBLOCKS; i++)
+	{
+		readInodeBlock(fd, INODETABSBLOCKNUM + i, blockBuffer);
+		int changed = 0;
+		for (int n = 0; n < validCount; n++)
+		{
+			if (validInodes[n] / inodesPerBlock != i)
+			{
+				continue;
+			}
+			Inode *inode = (Inode *)(blockBuffer + ((validInodes[n] % inodesPerBlock) * INODESIZE));
+			uint32_t *slots[15];
+			for (int k = 0; k < 12; k++)
+			{
+				slots[k] = &inode->directPointer[k];
+			}
+			slots[12] = &inode->singleIndirectPointer;
+			slots[13] = &inode->doubleIndirectPointer;
+			slots[14] = &inode->tripleIndirectPointer;
+			for (int k = 0; k < 15; k++)
+			{
+				uint32_t oldBlock = *slots[k];
+				if (oldBlock >= FIRSTDATABLOCKNUM && oldBlock <= LASTDATABLOCKNUM && newLocation[oldBlock] != 0 && newLocation[oldBlock] != oldBlock)
+				{
+					*slots[k] = newLocation[oldBlock];
+					changed = 1;
+				}
+			}
+		}
+		if (changed)
+		{
+			writeInodeBlock(fd, INODETABSBLOCKNUM + i, blockBuffer);
+		}
+	}
+
+	unsigned char *dataBitmap = arenaAllocBlock(&runArena);
+	readBlock(fd, DATABIMBLOCKNUM, dataBitmap);
+	for (uint32_t b = FIRSTDATABLOCKNUM; b <= LASTDATABLOCKNUM; b++)
+	{
+		// The files fill the blocks below next, except those of deleted inodes stepped around, which
+		// are free like every block no valid inode references
+		int isDeletedOnly = testBlockState(PLANEREFANY, b) && !testBlockState(PLANEREFVALID, b);
+		int isUsed = (b < next) && !isDeletedOnly;
+		if (isUsed)
+			setBit(dataBitmap, b - FIRSTDATABLOCKNUM);
+		else
+			removeBit(dataBitmap, b - FIRSTDATABLOCKNUM);
+	}
+	writeBlock(fd, DATABIMBLOCKNUM, dataBitmap);
+
+	printf("Defragmented: relocated %u blocks, files now occupy blocks %u-%u\n", moved, FIRSTDATABLOCKNUM, next - 1);
+	closeImage(fd);
+	arenaRelease(&runArena, mark);
+	return (int)moved;
+}
+
+// ! ############################## Discard ##############################
+
+// ? ############################## DISCARD FREED BLOCKS ##############################
+
+// Releases the storage of data blocks a repair of this run took out of the data bitmap. Blocks
+// reused since, e.g. by the duplicate fixer, are still marked in the bitmap and are left alone.
+// Runs of consecutive blocks are punched out of the image file with one fallocate each; where
+// punching is not supported they are overwritten with zeros instead. Every block goes to the undo
+// log first, so --undo brings the old contents back; a block the log could not take is kept, and
+// discarding stops there. Returns the number of blocks discarded, -1 if the log failed.
+int discardFreedBlocks(char *image)
+{
+	printf("Discarding freed blocks\n");
+	printf("---------------------------------\n");
+
+	int fd = openImage(image, O_RDWR);
+	ArenaMark mark = arenaMark(&runArena);
+	unsigned char *dataBitmap = arenaAllocBlock(&runArena);
+	unsigned char *zeroBlock = arenaAllocBlock(&runArena);
+	memset(zeroBlock, 0, BLOCKSIZE);
+	readBlock(fd, DATABIMBLOCKNUM, dataBitmap);
+
+	int canPunch = 1;
+	uint32_t discarded = 0;
+	uint32_t ranges = 0;
+	uint32_t zeroed = 0;
+	uint32_t b = FIRSTDATABLOCKNUM;
+	int isLogFailed = 0;
+	while (b <= LASTDATABLOCKNUM && !isLogFailed)
+	{
+		if (!testBlockState(PLANEFREED, b) || bitCheck(dataBitmap, b - FIRSTDATABLOCKNUM))
+		{
+			b++;
+			continue;
+		}
+		uint32_t runStart = b;
+		while (b <= LASTDATABLOCKNUM && testBlockState(PLANEFREED, b) && !bitCheck(dataBitmap, b - FIRSTDATABLOCKNUM))
+		{
+			if (logBlockForUndo(fd, b) != 0)
+			{
+				// The run ends before the block the log could not take
+				isLogFailed = 1;
+				break;
+			}
+			b++;
+		}
+		uint32_t runLength = b - runStart;
+		if (runLength == 0)
+		{
+			break;
+		}
+
+		if (canPunch && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+								  (off_t)runStart * BLOCKSIZE, (off_t)runLength * BLOCKSIZE) == 0)
+		{
+			noteBlocksDiscarded(fd, runStart, runLength, 1);
+		}
+		else
+		{
+			// Punching is not supported here, zero this run and the rest
+			canPunch = 0;
+			for (uint32_t z = runStart; z < b && !undoLogFailed; z++)
+			{
+				writeBlock(fd, z, zeroBlock);
+			}
+			noteBlocksDiscarded(fd, runStart, runLength, 0);
+			zeroed += runLength;
+			isLogFailed = undoLogFailed;
+		}
+		discarded += runLength;
+		ranges++;
+	}
+	if (discarded > 0)
+	{
+		fdatasync(fd);
+	}
+	clearBlockPlane(PLANEFREED);
+
+	if (zeroed > 0)
+	{
+		printf("Hole punching not supported. Zeroed %u of the discarded blocks instead.\n", zeroed);
+	}
+	if (isLogFailed)
+	{
+		printf("Stopped discarding: the undo log could not save the next block. It and every block after it were kept.\n");
+	}
+	printf("Discarded %u freed blocks in %u ranges\n", discarded, ranges);
+	printf("---------------------------------\n");
+	printf("\n");
+	arenaRelease(&runArena, mark);
+	closeImage(fd);
+	return isLogFailed ? -1 : (int)discarded;
+}
+
+// ! ############################## Block Map Export ##############################
+
+// ? ############################## EXPORT BLOCK MAP ##############################
+
+static uint64_t alignMapOffset(uint64_t offset)
+{
+	return (offset + 7) & ~(uint64_t)7;
+}
+
+// Writes the ownership map of the image as the run leaves it: one entry per block with its owning
+// inode, logical position and role, and per inode the extents of its data. The layouts are the ones
+// the last data bitmap walk recorded; only when something changed the trees after it, or no walk
+// ran, are they collected again. The map is written to <mapPath>.tmp and renamed into place, so a
+// reader never sees a half-written map.
+int exportBlockMap(char *image, char *mapPath, int checkErrors)
+{
+	ArenaMark mark = arenaMark(&runArena);
+	InodeLayout *layouts = walkLayouts.inodes;
+	uint32_t *validInodes = walkLayouts.validInodes;
+	int validCount = (int)walkLayouts.validCount;
+	if (!walkLayouts.isCurrent)
+	{
+		int fd = openImage(image, O_RDONLY);
+		layouts = arenaAlloc(&runArena, INODECOUNT * sizeof(InodeLayout), sizeof(uint64_t));
+		validInodes = arenaAlloc(&runArena, INODECOUNT * sizeof(uint32_t), sizeof(uint32_t));
+		validCount = collectImageLayout(fd, layouts, validInodes);
+		closeImage(fd);
+		if (validCount < 0)
+		{
+			printf("Block map export cancelled. %s was not written.\n", mapPath);
+			arenaRelease(&runArena, mark);
+			return -1;
+		}
+	}
+
+	// Extents can only be counted once the layouts are in, size the file for the worst case
+	uint32_t maxExtents = 0;
+	for (int n = 0; n < validCount; n++)
+	{
+		maxExtents += layouts[validInodes[n]].count;
+	}
+	uint64_t blockTableOffset = alignMapOffset(sizeof(BlockMapHeader));
+	uint64_t inodeTableOffset = alignMapOffset(blockTableOffset + (TOTALBLOCKS * sizeof(BlockMapEntry)));
+	uint64_t extentTableOffset = alignMapOffset(inodeTableOffset + (INODECOUNT * sizeof(BlockMapInode)));
+	size_t capacity = extentTableOffset + ((size_t)maxExtents * sizeof(BlockMapExtent));
+	unsigned char *map = arenaAlloc(&runArena, capacity, sizeof(uint64_t));
+	memset(map, 0, capacity);
+
+	BlockMapHeader *header = (BlockMapHeader *)map;
+	BlockMapEntry *blocks = (BlockMapEntry *)(map + blockTableOffset);
+	BlockMapInode *inodes = (BlockMapInode *)(map + inodeTableOffset);
+	BlockMapExtent *extents = (BlockMapExtent *)(map + extentTableOffset);
+
+	for (uint32_t b = 0; b < TOTALBLOCKS; b++)
+	{
+		blocks[b].owner = BLOCKMAPNOOWNER;
+		blocks[b].role = (b < FIRSTDATABLOCKNUM) ? BLOCKROLEMETADATA : BLOCKROLEFREE;
+	}
+
+	uint32_t extentCount = 0;
+	for (int n = 0; n < validCount; n++)
+	{
+		uint32_t inodeNum = validInodes[n];
+		const InodeLayout *layout = &layouts[inodeNum];
+		BlockMapInode *inode = &inodes[inodeNum];
+		inode->firstExtent = extentCount;
+		BlockMapExtent *current = NULL;
+		for (uint32_t k = 0; k < layout->count; k++)
+		{
+			const LayoutEntry *entry = &layout->entries[k];
+			BlockMapEntry *block = &blocks[entry->physical];
+			// After a check with errors a block may still have two owners, the first one keeps it
+			if (block->owner == BLOCKMAPNOOWNER)
+			{
+				block->owner = inodeNum;
+				block->logical = (uint32_t)entry->logical;
+				block->role = entry->level > 0 ? BLOCKROLEPOINTER : BLOCKROLEDATA;
+				block->level = (uint8_t)entry->level;
+			}
+			if (entry->level > 0)
+			{
+				inode->pointerBlocks++;
+				continue;
+			}
+
+			// Pre-order visits data in logical order, so extents grow at their end only
+			inode->dataBlocks++;
+			if (current != NULL && entry->logical == (uint64_t)current->logicalStart + current->length &&
+				entry->physical == current->physicalStart + current->length)
+			{
+				current->length++;
+				continue;
+			}
+			current = &extents[extentCount++];
+			current->logicalStart = (uint32_t)entry->logical;
+			current->physicalStart = entry->physical;
+			current->length = 1;
+		}
+		inode->extentCount = extentCount - inode->firstExtent;
+	}
+
+	memcpy(header->magic, BLOCKMAPMAGIC, sizeof(BLOCKMAPMAGIC));
+	header->version = BLOCKMAPVERSION;
+	header->headerSize = sizeof(BlockMapHeader);
+	header->blockSize = BLOCKSIZE;
+	header->totalBlocks = TOTALBLOCKS;
+	header->inodeCount = INODECOUNT;
+	header->firstDataBlock = FIRSTDATABLOCKNUM;
+	header->flags = checkErrors ? BLOCKMAPCHECKERRORS : 0;
+	header->extentCount = extentCount;
+	header->blockTableOffset = blockTableOffset;
+	header->inodeTableOffset = inodeTableOffset;
+	header->extentTableOffset = extentTableOffset;
+	size_t mapSize = extentTableOffset + ((size_t)extentCount * sizeof(BlockMapExtent));
+#if HOSTISBIGENDIAN
+	// Everything but the header's 64-bit offsets and the role/level bytes of a block entry is a
+	// 32-bit word
+	swapLE32Words(&header->version, 8);
+	header->blockTableOffset = __builtin_bswap64(header->blockTableOffset);
+	header->inodeTableOffset = __builtin_bswap64(header->inodeTableOffset);
+	header->extentTableOffset = __builtin_bswap64(header->extentTableOffset);
+	for (uint32_t b = 0; b < TOTALBLOCKS; b++)
+	{
+		swapLE32Words(&blocks[b].owner, 2);
+	}
+	swapLE32Words((uint32_t *)inodes, INODECOUNT * (sizeof(BlockMapInode) / sizeof(uint32_t)));
+	swapLE32Words((uint32_t *)extents, extentCount * (sizeof(BlockMapExtent) / sizeof(uint32_t)));
+#endif
+
+	char tmpPath[MAXPATHLEN];
+	snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", mapPath);
+	int mapFd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	int written = (mapFd >= 0) && write(mapFd, map, mapSize) == (ssize_t)mapSize && fsync(mapFd) == 0;
+	if (mapFd >= 0)
+	{
+		close(mapFd);
+	}
+	if (!written || rename(tmpPath, mapPath) != 0)
+	{
+		printf("Error: Could not write block map %s.\n", mapPath);
+		unlink(tmpPath);
+		arenaRelease(&runArena, mark);
+		return -1;
+	}
+
+	printf("Exported block map of %d inodes and %u extents to %s\n", validCount, extentCount, mapPath);
+	printf("---------------------------------\n");
+	printf("\n");
+	arenaRelease(&runArena, mark);
+	return 0;
+}
+
+// ! ############################## Block Groups ##############################
+
+// Inode table blocks of one group
+static uint32_t groupInodeTableBlocks(const GroupLayout *layout)
+{
+	return (uint32_t)(((uint64_t)layout->inodesPerGroup * INODESIZE + BLOCKSIZE - 1) / BLOCKSIZE);
+}
+
+// ? ############################## GROUP CANONICAL LAYOUT ##############################
+
+// Where group g keeps its metadata. Group 0 starts with the superblock and the descriptor table,
+// every other group with its own bitmaps. The free counts are left for the caller to fill in.
+void groupCanonicalLayout(const GroupLayout *layout, uint32_t groupNum, GroupDescriptor *descriptor)
+{
+	uint32_t metaStart = (groupNum == 0) ? layout->descriptorBlock + 1 : groupNum * layout->blocksPerGroup;
+	memset(descriptor, 0, sizeof(*descriptor));
+	descriptor->inodeBitmapBlock = metaStart;
+	descriptor->dataBitmapBlock = metaStart + 1;
+	descriptor->inodeTableBlock = metaStart + 2;
+	descriptor->firstDataBlock = descriptor->inodeTableBlock + groupInodeTableBlocks(layout);
+}
+
+// ? ############################## READ GROUP LAYOUT ##############################
+
+// Reads the group extension of the superblock. Returns 1 for a usable grouped image, 0 for a
+// legacy image and -1 when the extension is there but describes an impossible geometry.
+int readGroupLayout(char *image, GroupLayout *layout)
+{
+	int fd = openImage(image, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	Superblock superblock;
+	readSuperblock(fd, &superblock);
+	closeImage(fd);
+
+	memcpy(layout, superblock.reserved + sizeof(CleanStateMarker), sizeof(*layout));
+	if (layout->magic != GROUPLAYOUTMAGIC)
+	{
+		return 0;
+	}
+
+	GroupDescriptor first;
+	groupCanonicalLayout(layout, 0, &first);
+	if (layout->groupCount == 0 || layout->groupCount > MAXGROUPS ||
+		layout->blocksPerGroup == 0 || layout->blocksPerGroup > MAXBLOCKSPERGROUP ||
+		layout->inodesPerGroup == 0 || layout->inodesPerGroup > BLOCKSIZE * 8 ||
+		layout->descriptorBlock != SUPERBLOCKNUM + 1 || first.firstDataBlock >= layout->blocksPerGroup)
+	{
+		return -1;
+	}
+	return 1;
+}
+
+// Which group a pointer lands in, or -1 when it names no data block of any group
+static int64_t dataBlockGroup(const GroupLayout *layout, uint32_t blockNum)
+{
+	uint32_t groupNum = blockNum / layout->blocksPerGroup;
+	if (groupNum >= layout->groupCount)
+	{
+		return -1;
+	}
+	GroupDescriptor descriptor;
+	groupCanonicalLayout(layout, groupNum, &descriptor);
+	return blockNum < descriptor.firstDataBlock ? -1 : (int64_t)groupNum;
+}
+
+// ? ############################## CLAIM GROUP BLOCK ##############################
+
+// Marks a data block of this group as referenced. A second claim is a duplicate reference and returns 0.
+static int claimGroupBlock(GroupCheck *check, FILE *report, uint32_t blockNum, uint32_t inodeNum)
+{
+	uint32_t index = blockNum - check->expected.firstDataBlock;
+	if (bitCheck(check->referenced, index))
+	{
+		fprintf(report, "Error: Block %u is referenced more than once, again by inode %u\n", blockNum, inodeNum);
+		check->errors++;
+		return 0;
+	}
+	setBit(check->referenced, index);
+	return 1;
+}
+
+// Blocks of other groups are only queued here. The merge step claims them in the owning group and
+// walks the tree below a queued pointer block then, so a pointer block two groups share is claimed
+// and walked once, and only the shared block itself is reported as a duplicate.
+static void queueGroupReference(GroupCheck *check, uint32_t blockNum, uint32_t inodeNum, int level)
+{
+	if (check->outboxCount == check->outboxCapacity)
+	{
+		uint32_t newCapacity = check->outboxCapacity ? check->outboxCapacity * 2 : 64;
+		CrossGroupReference *grown = realloc(check->outbox, newCapacity * sizeof(*grown));
+		if (grown == NULL)
+		{
+			fprintf(check->report, "Error: Out of memory queueing cross-group reference to block %u\n", blockNum);
+			check->errors++;
+			return;
+		}
+		check->outbox = grown;
+		check->outboxCapacity = newCapacity;
+	}
+	check->outbox[check->outboxCount].blockNum = blockNum;
+	check->outbox[check->outboxCount].inodeNum = inodeNum;
+	check->outbox[check->outboxCount].level = (uint32_t)level;
+	check->outboxCount++;
+}
+
+// ? ############################## WALK GROUP POINTER ##############################
+
+static const char *groupPointerKinds[] = {"data", "single indirect", "double indirect", "triple indirect"};
+
+// scratch holds one pointer block per tree level and belongs to the calling thread, so the
+// recursion keeps no block on the stack
+void walkGroupPointer(GroupCheck *check, const GroupLayout *layout, int fd, unsigned char *scratch, uint32_t inodeNum,
+					  uint32_t blockNum, int level)
+{
+	if (blockNum == 0)
+	{
+		return;
+	}
+	int64_t targetGroup = dataBlockGroup(layout, blockNum);
+	if (targetGroup < 0)
+	{
+		fprintf(check->report, "Error: Inode %u has bad %s pointer (block %u). Not a data block of any group.\n",
+				inodeNum, groupPointerKinds[level], blockNum);
+		check->errors++;
+		return;
+	}
+	if ((uint32_t)targetGroup != check->groupNum)
+	{
+		queueGroupReference(check, blockNum, inodeNum, level);
+		return;
+	}
+	// A repeat claim stops here, its tree was walked with the first one
+	if (!claimGroupBlock(check, check->report, blockNum, inodeNum) || level == 0)
+	{
+		return;
+	}
+
+	uint32_t *pointers = (uint32_t *)(scratch + (level * BLOCKSIZE));
+	readWordBlock(fd, blockNum, pointers);
+	notePointerBlockVisited();
+	for (uint32_t k = 0; k < POINTERSPBLOCK; k++)
+	{
+		walkGroupPointer(check, layout, fd, scratch, inodeNum, pointers[k], level - 1);
+	}
+}
+
+// ? ############################## CHECK GROUP ##############################
+
+// Checks one group on its own: its inode bitmap against its inode table, and the block trees of
+// its valid inodes. Only references into other groups are left for the merge step.
+void checkGroup(GroupCheck *check, const GroupLayout *layout, int fd, unsigned char *scratch)
+{
+	groupCanonicalLayout(layout, check->groupNum, &check->expected);
+	FILE *report = check->report;
+	readBlock(fd, check->expected.inodeBitmapBlock, check->inodeBitmap);
+	readBlock(fd, check->expected.dataBitmapBlock, check->dataBitmap);
+
+	uint32_t inodesPerBlock = BLOCKSIZE / INODESIZE;
+	uint32_t firstInode = check->groupNum * layout->inodesPerGroup;
+	unsigned char blockBuffer[BLOCKSIZE];
+	for (uint32_t i = 0; i < layout->inodesPerGroup; i++)
+	{
+		if (i % inodesPerBlock == 0)
+		{
+			readInodeBlock(fd, check->expected.inodeTableBlock + (i / inodesPerBlock), blockBuffer);
+			noteInodesScanned(inodesPerBlock);
+		}
+		const Inode *inode = (const Inode *)(blockBuffer + ((i % inodesPerBlock) * INODESIZE));
+		uint32_t inodeNum = firstInode + i;
+		int isInodeValid = inode->numHardLinks > 0 && inode->deletionTime == 0;
+		int isMarkedInBitmap = bitCheck(check->inodeBitmap, i);
+
+		if (isMarkedInBitmap && !isInodeValid)
+		{
+			fprintf(report, "Error: Inode %u is marked in bitmap but invalid (links=%u, del_time=%u)\n",
+					inodeNum, inode->numHardLinks, inode->deletionTime);
+			check->errors++;
+			check->inodeBitmapErrors++;
+		}
+		if (isInodeValid && !isMarkedInBitmap)
+		{
+			fprintf(report, "Error: Valid inode %u (links=%u) not marked in bitmap\n", inodeNum, inode->numHardLinks);
+			check->errors++;
+			check->inodeBitmapErrors++;
+		}
+		if (!isInodeValid)
+		{
+			continue;
+		}
+		setBit(check->validInodes, i);
+
+		for (int d = 0; d < 12; d++)
+		{
+			walkGroupPointer(check, layout, fd, scratch, inodeNum, inode->directPointer[d], 0);
+		}
+		walkGroupPointer(check, layout, fd, scratch, inodeNum, inode->singleIndirectPointer, 1);
+		walkGroupPointer(check, layout, fd, scratch, inodeNum, inode->doubleIndirectPointer, 2);
+		walkGroupPointer(check, layout, fd, scratch, inodeNum, inode->tripleIndirectPointer, 3);
+	}
+}
+
+// ? ############################## CLAIM MERGED POINTER ##############################
+
+// The merge step's walk: claims a queued block in the group that owns it and walks the tree below
+// a pointer block, claiming each block directly in its own group since every group's state is at
+// hand by now. It runs on the calling thread only, so the walker scratch blocks serve it.
+static void claimMergedPointer(GroupCheck **checks, const GroupLayout *layout, int fd, uint32_t inodeNum, uint32_t blockNum, int level)
+{
+	if (blockNum == 0)
+	{
+		return;
+	}
+	int64_t targetGroup = dataBlockGroup(layout, blockNum);
+	if (targetGroup < 0)
+	{
+		printf("Error: Inode %u has bad %s pointer (block %u). Not a data block of any group.\n",
+			   inodeNum, groupPointerKinds[level], blockNum);
+		checks[inodeNum / layout->inodesPerGroup]->errors++;
+		return;
+	}
+	if (!claimGroupBlock(checks[targetGroup], stdout, blockNum, inodeNum) || level == 0)
+	{
+		return;
+	}
+
+	uint32_t *pointers = (uint32_t *)walkerScratchBlock(level);
+	readWordBlock(fd, blockNum, pointers);
+	notePointerBlockVisited();
+	for (uint32_t k = 0; k < POINTERSPBLOCK; k++)
+	{
+		claimMergedPointer(checks, layout, fd, inodeNum, pointers[k], level - 1);
+	}
+}
+
+static void *checkGroupsWorker(void *arg)
+{
+	GroupPool *pool = arg;
+	unsigned char *scratch = NULL;
+	if (posix_memalign((void **)&scratch, BLOCKSIZE, (MAXTREEDEPTH + 1) * BLOCKSIZE) != 0)
+	{
+		// The calling thread checks whatever groups this worker leaves
+		return NULL;
+	}
+	for (;;)
+	{
+		if (isCheckCancelled())
+		{
+			break;
+		}
+		uint32_t groupNum = atomic_fetch_add(&pool->nextGroup, 1);
+		if (groupNum >= pool->layout->groupCount)
+		{
+			break;
+		}
+		checkGroup(pool->checks[groupNum], pool->layout, pool->fd, scratch);
+	}
+	free(scratch);
+	return NULL;
+}
+
+// Copies bits [0, count) of expected over bitMap and reports whether anything changed
+static int syncBitmapRange(unsigned char *bitMap, const unsigned char *expected, uint32_t count)
+{
+	int changed = 0;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (bitCheck(bitMap, i) != bitCheck(expected, i))
+		{
+			bitCheck(expected, i) ? setBit(bitMap, i) : removeBit(bitMap, i);
+			changed = 1;
+		}
+	}
+	return changed;
+}
+
+static void freeGroupChecks(GroupCheck **checks, uint32_t count)
+{
+	for (uint32_t g = 0; checks != NULL && g < count; g++)
+	{
+		if (checks[g] != NULL && checks[g]->report != NULL)
+		{
+			fclose(checks[g]->report);
+		}
+		if (checks[g] != NULL)
+		{
+			free(checks[g]->reportText);
+			free(checks[g]->outbox);
+			free(checks[g]);
+		}
+	}
+	free(checks);
+}
+
+// ? ############################## CHECK GROUPED IMAGE ##############################
+
+// Checks an image with the block group extension. Groups are checked independently on up to
+// --jobs threads, each with its own bitmaps and reference map; references that cross a group
+// boundary are claimed in a merge step afterwards. The superblock, the descriptors and the group
+// bitmaps are then repaired; bad pointers and duplicate blocks are reported. Returns 1 when any
+// error was left unrepaired.
+int checkGroupedImage(char *image, const GroupLayout *layout)
+{
+	printf("Checking block groups of image: %s (%u groups of %u blocks, %u inodes each)\n", image,
+		   layout->groupCount, layout->blocksPerGroup, layout->inodesPerGroup);
+	printf("---------------------------------\n");
+
+	int fd = openImage(image, O_RDWR);
+	if (fd < 0)
+	{
+		printf("Error: Cannot open image %s\n", image);
+		return 1;
+	}
+
+	struct stat st;
+	uint64_t imageBytes = (uint64_t)layout->groupCount * layout->blocksPerGroup * BLOCKSIZE;
+	if (fstat(fd, &st) == 0 && imageHandles[fd].compressed != NULL)
+	{
+		st.st_size = (off_t)imageHandles[fd].compressed->decompressedSize;
+	}
+	if ((uint64_t)st.st_size < imageBytes)
+	{
+		printf("Warning: Image is %lld bytes, the group layout needs %llu. Missing blocks read as zeros.\n",
+			   (long long)st.st_size, (unsigned long long)imageBytes);
+	}
+
+	// Each group gets its own state, so workers never share anything but the image
+	GroupCheck **checks = calloc(layout->groupCount, sizeof(*checks));
+	for (uint32_t g = 0; checks != NULL && g < layout->groupCount; g++)
+	{
+		checks[g] = calloc(1, sizeof(GroupCheck));
+		if (checks[g] == NULL ||
+			(checks[g]->report = open_memstream(&checks[g]->reportText, &checks[g]->reportSize)) == NULL)
+		{
+			printf("Error: Out of memory setting up group %u.\n", g);
+			freeGroupChecks(checks, layout->groupCount);
+			closeImage(fd);
+			return 1;
+		}
+		checks[g]->groupNum = g;
+	}
+	if (checks == NULL)
+	{
+		printf("Error: Out of memory setting up %u groups.\n", layout->groupCount);
+		closeImage(fd);
+		return 1;
+	}
+
+	setCheckPhase("Groups");
+	GroupPool pool = {.checks = checks, .layout = layout, .fd = fd};
+	atomic_init(&pool.nextGroup, 0);
+	uint32_t numWorkers = walkJobs < 1 ? 1 : (uint32_t)walkJobs;
+	if (numWorkers > layout->groupCount)
+	{
+		numWorkers = layout->groupCount;
+	}
+	pthread_t threads[numWorkers];
+	uint32_t started = 0;
+	for (uint32_t w = 1; w < numWorkers; w++)
+	{
+		if (pthread_create(&threads[w], NULL, checkGroupsWorker, &pool) == 0)
+		{
+			started = w;
+		}
+		else
+		{
+			break;
+		}
+	}
+	// The calling thread checks groups too, between groups it services the progress signals
+	for (;;)
+	{
+		if (pollCheckStatus())
+		{
+			break;
+		}
+		uint32_t groupNum = atomic_fetch_add(&pool.nextGroup, 1);
+		if (groupNum >= layout->groupCount)
+		{
+			break;
+		}
+		checkGroup(checks[groupNum], layout, fd, walkerScratchBlock(0));
+	}
+	for (uint32_t w = 1; w <= started; w++)
+	{
+		pthread_join(threads[w], NULL);
+	}
+	if (isCheckCancelled())
+	{
+		// Nothing was written yet
+		freeGroupChecks(checks, layout->groupCount);
+		closeImage(fd);
+		return reportCheckCancelled();
+	}
+
+	int errors = 0;
+	int fixed = 0;
+	for (uint32_t g = 0; g < layout->groupCount; g++)
+	{
+		fixed += checks[g]->inodeBitmapErrors;
+		fclose(checks[g]->report);
+		checks[g]->report = NULL;
+		if (checks[g]->reportSize > 0)
+		{
+			printf("Group %u:\n%s", g, checks[g]->reportText);
+		}
+		errors += checks[g]->errors;
+		checks[g]->errors = 0;
+	}
+
+	// Merge: claim the cross-group references in the groups that own the blocks, in group order
+	setCheckPhase("Group Merge");
+	printf("---------------------------------\n");
+	printf("Merging cross-group references\n");
+	uint32_t crossReferences = 0;
+	for (uint32_t g = 0; g < layout->groupCount; g++)
+	{
+		for (uint32_t r = 0; r < checks[g]->outboxCount; r++)
+		{
+			const CrossGroupReference *ref = &checks[g]->outbox[r];
+			claimMergedPointer(checks, layout, fd, ref->inodeNum, ref->blockNum, (int)ref->level);
+			crossReferences++;
+		}
+	}
+	printf("%u references into other groups queued by the group checks\n", crossReferences);
+	for (uint32_t g = 0; g < layout->groupCount; g++)
+	{
+		errors += checks[g]->errors;
+	}
+
+	// Bitmaps and free counts, now that every group knows all references into it
+	setCheckPhase("Group Bitmaps");
+	printf("---------------------------------\n");
+	printf("Validating group bitmaps and descriptors\n");
+	uint32_t descriptorTable[POINTERSPBLOCK];
+	readWordBlock(fd, layout->descriptorBlock, descriptorTable);
+	int descriptorsChanged = 0;
+	for (uint32_t g = 0; g < layout->groupCount; g++)
+	{
+		GroupCheck *check = checks[g];
+		GroupDescriptor *expected = &check->expected;
+		uint32_t dataBlocks = (g + 1) * layout->blocksPerGroup - expected->firstDataBlock;
+		for (uint32_t i = 0; i < dataBlocks; i++)
+		{
+			int isReferenced = bitCheck(check->referenced, i);
+			int isMarked = bitCheck(check->dataBitmap, i);
+			if (isMarked && !isReferenced)
+			{
+				printf("Error: Block %u is marked in the group %u bitmap but not referenced by a valid inode\n",
+					   expected->firstDataBlock + i, g);
+				errors++;
+				fixed++;
+			}
+			else if (isReferenced && !isMarked)
+			{
+				printf("Error: Block %u is referenced by a valid inode but not marked in the group %u bitmap\n",
+					   expected->firstDataBlock + i, g);
+				errors++;
+				fixed++;
+			}
+		}
+		expected->freeDataBlocks = dataBlocks - countBitmapBits(check->referenced, (dataBlocks + 7) / 8);
+		expected->freeInodes = layout->inodesPerGroup - countBitmapBits(check->validInodes, (layout->inodesPerGroup + 7) / 8);
+
+		if (syncBitmapRange(check->inodeBitmap, check->validInodes, layout->inodesPerGroup))
+		{
+			writeBlock(fd, expected->inodeBitmapBlock, check->inodeBitmap);
+		}
+		if (syncBitmapRange(check->dataBitmap, check->referenced, dataBlocks))
+		{
+			writeBlock(fd, expected->dataBitmapBlock, check->dataBitmap);
+		}
+
+		GroupDescriptor *stored = (GroupDescriptor *)descriptorTable + g;
+		if (memcmp(stored, expected, offsetof(GroupDescriptor, reserved)) != 0)
+		{
+			printf("Error: Group %u descriptor is (bitmaps %u/%u, table %u, data %u, free %u/%u), expected (bitmaps %u/%u, table %u, data %u, free %u/%u)\n",
+				   g, stored->inodeBitmapBlock, stored->dataBitmapBlock, stored->inodeTableBlock, stored->firstDataBlock,
+				   stored->freeDataBlocks, stored->freeInodes, expected->inodeBitmapBlock, expected->dataBitmapBlock,
+				   expected->inodeTableBlock, expected->firstDataBlock, expected->freeDataBlocks, expected->freeInodes);
+			memcpy(stored, expected, offsetof(GroupDescriptor, reserved));
+			descriptorsChanged = 1;
+			errors++;
+			fixed++;
+		}
+	}
+	if (descriptorsChanged)
+	{
+		writeWordBlock(fd, layout->descriptorBlock, descriptorTable);
+	}
+
+	// The superblock describes group 0 and the volume as a whole
+	Superblock superblock;
+	readSuperblock(fd, &superblock);
+	Superblock expectedSuperblock = superblock;
+	expectedSuperblock.magicByte = MAGICNUM;
+	expectedSuperblock.blockSize = BLOCKSIZE;
+	expectedSuperblock.totalBlocks = layout->groupCount * layout->blocksPerGroup;
+	expectedSuperblock.ibimBlock = checks[0]->expected.inodeBitmapBlock;
+	expectedSuperblock.dbimBlock = checks[0]->expected.dataBitmapBlock;
+	expectedSuperblock.itabStartBlock = checks[0]->expected.inodeTableBlock;
+	expectedSuperblock.firstDataBlock = checks[0]->expected.firstDataBlock;
+	expectedSuperblock.inodeSize = INODESIZE;
+	expectedSuperblock.inodeCount = layout->groupCount * layout->inodesPerGroup;
+	if (memcmp(&superblock, &expectedSuperblock, offsetof(Superblock, reserved)) != 0)
+	{
+		printf("Error: Superblock does not match the group layout. Fixing it.\n");
+		writeSuperblock(fd, &expectedSuperblock);
+		errors++;
+		fixed++;
+	}
+
+	printf("---------------------------------\n");
+	if (errors > 0 && fixed == errors)
+	{
+		printf("Block group validation failed. Fixed all %d errors.\n", errors);
+	}
+	else if (errors > 0)
+	{
+		printf("Block group validation failed. Fixed %d of %d errors, bad pointers and duplicate blocks are only reported.\n",
+			   fixed, errors);
+	}
+	else
+	{
+		printf("Block group validation successful. No errors found.\n");
+	}
+	printf("---------------------------------\n");
+	printf("\n");
+
+	freeGroupChecks(checks, layout->groupCount);
+	closeImage(fd);
+	// Like the single-volume check, errors left unrepaired fail the run
+	return fixed < errors ? 1 : 0;
+}
+
+// ! ############################## Compressed Images ##############################
+
+// zstd stores every integer of its frame headers and seek table little-endian
+static uint32_t readLE32(const unsigned char *bytes)
+{
+	return (uint32_t)bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+// ? ############################## PROBE COMPRESSED IMAGE ##############################
+
+// Whether the image file starts with a zstd frame. A VSFS image starts with the superblock magic,
+// so the two can not be confused.
+int isZstdImageFile(const char *image)
+{
+	int fd = open(image, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	unsigned char magic[4];
+	int isZstd = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && readLE32(magic) == ZSTDFRAMEMAGIC;
+	close(fd);
+	return isZstd;
+}
+
+#ifdef VSFSCK_WITH_ZSTD
+
+// ? ############################## LOAD COMPRESSED IMAGE ##############################
+
+// Builds the frame index of a zstd seekable image from the seek table in its trailing skippable
+// frame. Each image is indexed once per run, however often the phases reopen it.
+CompressedImage *loadCompressedImage(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		return NULL;
+	}
+	CompressedImage *unused = NULL;
+	for (int i = 0; i < MAXCOMPRESSEDIMAGES; i++)
+	{
+		CompressedImage *candidate = &compressedImages[i];
+		if (candidate->isLoaded && candidate->device == st.st_dev && candidate->inode == st.st_ino)
+		{
+			return candidate;
+		}
+		if (!candidate->isLoaded && unused == NULL)
+		{
+			unused = candidate;
+		}
+	}
+	if (unused == NULL || (uint64_t)st.st_size < SEEKTABLEFOOTERSIZE + 8)
+	{
+		return NULL;
+	}
+
+	unsigned char footer[SEEKTABLEFOOTERSIZE];
+	if (pread(fd, footer, sizeof(footer), st.st_size - SEEKTABLEFOOTERSIZE) != sizeof(footer) ||
+		readLE32(footer + 5) != SEEKTABLEMAGIC || (footer[4] & 0x7C) != 0)
+	{
+		printf("Error: Compressed image has no zstd seek table. Recompress it in the seekable format.\n");
+		return NULL;
+	}
+	uint32_t numFrames = readLE32(footer);
+	uint32_t entrySize = (footer[4] & 0x80) ? 12 : 8; // entries carry a checksum when bit 7 is set
+	uint64_t tableSize = 8 + ((uint64_t)numFrames * entrySize) + SEEKTABLEFOOTERSIZE;
+	if (numFrames == 0 || tableSize > (uint64_t)st.st_size)
+	{
+		printf("Error: Compressed image seek table is damaged (%u frames).\n", numFrames);
+		return NULL;
+	}
+
+	unsigned char *table = malloc(tableSize);
+	CompressedFrame *frames = calloc(numFrames, sizeof(*frames));
+	unsigned char *isFrameDamaged = calloc(numFrames, 1);
+	uint64_t tableStart = (uint64_t)st.st_size - tableSize;
+	int isValid = table != NULL && frames != NULL && isFrameDamaged != NULL &&
+				  pread(fd, table, tableSize, (off_t)tableStart) == (ssize_t)tableSize &&
+				  readLE32(table) == SEEKTABLESKIPPABLEMAGIC && readLE32(table + 4) == tableSize - 8;
+
+	uint64_t compressedOffset = 0;
+	uint64_t decompressedOffset = 0;
+	uint32_t largestCompressed = 0;
+	for (uint32_t f = 0; isValid && f < numFrames; f++)
+	{
+		const unsigned char *entry = table + 8 + ((size_t)f * entrySize);
+		frames[f].compressedOffset = compressedOffset;
+		frames[f].decompressedOffset = decompressedOffset;
+		frames[f].compressedSize = readLE32(entry);
+		frames[f].decompressedSize = readLE32(entry + 4);
+		isValid = frames[f].decompressedSize > 0 && frames[f].decompressedSize <= MAXCOMPRESSEDFRAMESIZE &&
+				  frames[f].compressedSize > 0 && frames[f].compressedSize <= MAXCOMPRESSEDFRAMESIZE;
+		compressedOffset += frames[f].compressedSize;
+		decompressedOffset += frames[f].decompressedSize;
+		if (frames[f].compressedSize > largestCompressed)
+		{
+			largestCompressed = frames[f].compressedSize;
+		}
+	}
+	// The frames have to tile the file up to the seek table exactly
+	isValid = isValid && compressedOffset == tableStart;
+	free(table);
+
+	unsigned char *compressedBuffer = isValid ? malloc(largestCompressed) : NULL;
+	if (compressedBuffer == NULL)
+	{
+		printf("Error: Compressed image seek table does not match its frames.\n");
+		free(frames);
+		free(isFrameDamaged);
+		return NULL;
+	}
+
+	CompressedImage *image = unused;
+	memset(image->cacheFrame, 0, sizeof(image->cacheFrame));
+	image->device = st.st_dev;
+	image->inode = st.st_ino;
+	image->frames = frames;
+	image->isFrameDamaged = isFrameDamaged;
+	image->numFrames = numFrames;
+	image->decompressedSize = decompressedOffset;
+	image->compressedBuffer = compressedBuffer;
+	image->framesDecompressed = 0;
+	pthread_mutex_init(&image->lock, NULL);
+	image->isLoaded = 1;
+	return image;
+}
+
+// Returns the decompressed frame, from the cache or freshly decompressed into the least recently
+// used slot. Caller holds image->lock.
+static const unsigned char *compressedFrame(CompressedImage *image, int fd, uint32_t frameNum)
+{
+	uint32_t victim = 0;
+	for (uint32_t slot = 0; slot < COMPRESSEDCACHEFRAMES; slot++)
+	{
+		if (image->cacheFrame[slot] == frameNum + 1)
+		{
+			image->cacheUse[slot] = ++image->useClock;
+			return image->cacheData[slot];
+		}
+		if (image->cacheUse[slot] < image->cacheUse[victim])
+		{
+			victim = slot;
+		}
+	}
+
+	const CompressedFrame *frame = &image->frames[frameNum];
+	if (image->isFrameDamaged[frameNum])
+	{
+		return NULL;
+	}
+	if (image->cacheCapacity[victim] < frame->decompressedSize)
+	{
+		unsigned char *grown = realloc(image->cacheData[victim], frame->decompressedSize);
+		if (grown == NULL)
+		{
+			return NULL;
+		}
+		image->cacheData[victim] = grown;
+		image->cacheCapacity[victim] = frame->decompressedSize;
+	}
+	image->cacheFrame[victim] = 0;
+	size_t got = 0;
+	if (pread(fd, image->compressedBuffer, frame->compressedSize, (off_t)frame->compressedOffset) == (ssize_t)frame->compressedSize)
+	{
+		got = ZSTD_decompress(image->cacheData[victim], frame->decompressedSize, image->compressedBuffer, frame->compressedSize);
+	}
+	if (ZSTD_isError(got) || got != frame->decompressedSize)
+	{
+		printf("Error: Frame %u of the compressed image is damaged (%s). Its blocks read as zeros.\n", frameNum,
+			   ZSTD_isError(got) ? ZSTD_getErrorName(got) : "wrong size");
+		image->isFrameDamaged[frameNum] = 1;
+		return NULL;
+	}
+	image->cacheFrame[victim] = frameNum + 1;
+	image->cacheUse[victim] = ++image->useClock;
+	image->framesDecompressed++;
+	return image->cacheData[victim];
+}
+
+// ? ############################## READ COMPRESSED BLOCK ##############################
+
+// Serves a block from the frames it spans. Anything past the decompressed image, or in a frame that
+// fails to decompress, reads as zeros.
+void readCompressedBlock(int fd, uint32_t blockNum, unsigned char *buffer)
+{
+	CompressedImage *image = imageHandles[fd].compressed;
+	uint64_t offset = (uint64_t)blockNum * BLOCKSIZE;
+	uint32_t copied = 0;
+	memset(buffer, 0, BLOCKSIZE);
+
+	pthread_mutex_lock(&image->lock);
+	while (copied < BLOCKSIZE && offset < image->decompressedSize)
+	{
+		// Last frame starting at or before offset
+		uint32_t low = 0;
+		uint32_t high = image->numFrames - 1;
+		while (low < high)
+		{
+			uint32_t mid = (low + high + 1) / 2;
+			if (image->frames[mid].decompressedOffset <= offset)
+			{
+				low = mid;
+			}
+			else
+			{
+				high = mid - 1;
+			}
+		}
+		const CompressedFrame *frame = &image->frames[low];
+		uint64_t within = offset - frame->decompressedOffset;
+		uint32_t take = BLOCKSIZE - copied;
+		if (take > frame->decompressedSize - within)
+		{
+			take = (uint32_t)(frame->decompressedSize - within);
+		}
+		const unsigned char *data = compressedFrame(image, fd, low);
+		if (data != NULL)
+		{
+			memcpy(buffer + copied, data + within, take);
+		}
+		copied += take;
+		offset += take;
+	}
+	pthread_mutex_unlock(&image->lock);
+}
+
+#endif // VSFSCK_WITH_ZSTD
+
+// ? ############################## REPORT COMPRESSED IMAGE ##############################
+
+// Compressed images are checked read-only, so the repairs the check settled on are only reported
+void reportCompressedImage(void)
+{
+	for (int i = 0; i < MAXCOMPRESSEDIMAGES; i++)
+	{
+		const CompressedImage *image = &compressedImages[i];
+		if (image->isLoaded)
+		{
+			printf("Compressed image: %u frame decompressions, the image has %u frames.\n", image->framesDecompressed,
+				   image->numFrames);
+		}
+	}
+	if (unwrittenRepairBlocks > 0)
+	{
+		printf("The image is compressed, so %u repaired blocks were not written. Decompress it and rerun the checker to apply the repairs.\n",
+			   unwrittenRepairBlocks);
+	}
 }
\ No newline at end of file